@@ -454,6 +454,33 @@ size_t comux_cinfo_data_read(comux_cinfo_t* cinfo, int fd)
     return total_rcount;
 }
 
+size_t comux_cinfo_data_pread(comux_cinfo_t* cinfo, int fd)
+{
+    // cap the number of bytes we'll read, just like 'comux_cinfo_data_read'
+    uint64_t cap = cinfo->len > COMUX_CHUNK_DATA_MAXLEN ?
+                   COMUX_CHUNK_DATA_MAXLEN : cinfo->len;
+
+    // since we know exactly how many bytes we want, we'll read them straight
+    // into the buffer's memory (+1 for the null terminator)
+    buffer_init(&cinfo->data, cap + 1);
+    char* dptr = buffer_dptr(&cinfo->data);
+    off_t offset = comux_cinfo_data_offset(cinfo);
+    ssize_t rcount = 0;
+    size_t total_rcount = 0;
+    while (total_rcount < cap &&
+           (rcount = pread(fd, dptr + total_rcount, cap - total_rcount,
+                           offset + total_rcount)) > 0)
+    { total_rcount += rcount; }
+    // check for read-error
+    if (rcount == -1)
+    { fatality_errno(errno, "failed to read bytes from fd %d", fd); }
+
+    cinfo->data.size = total_rcount;
+    dptr[total_rcount] = '\0';
+    cinfo->len = total_rcount;
+    return total_rcount;
+}
+
 size_t comux_cinfo_data_read_buffer(comux_cinfo_t* cinfo, char* buff,
                                     size_t buff_len)
 {
@@ -471,6 +498,68 @@ size_t comux_cinfo_data_read_buffer(comux_cinfo_t* cinfo, char* buff,
     return cap;
 }
 
+size_t comux_cinfo_segment_size(comux_cinfo_t* cinfo)
+{
+    uint32_t code = (cinfo->flags & COMUX_CHUNK_FLAGS_SEGMENT_MASK) >>
+                    COMUX_CHUNK_FLAGS_SEGMENT_SHIFT;
+    return code ? (size_t) 1 << (code - 1) : 0;
+}
+
+uint32_t comux_cinfo_segment_gap(comux_cinfo_t* cinfo)
+{
+    uint32_t code = (cinfo->flags & COMUX_CHUNK_FLAGS_GAP_MASK) >>
+                    COMUX_CHUNK_FLAGS_GAP_SHIFT;
+    return code ? (uint32_t) 1 << (code - 1) : 0;
+}
+
+// Helper function that turns a value into a 4-bit code: 0 for 0, otherwise
+// one more than the value's base-2 logarithm (rounded down).
+static uint32_t comux_segment_code(uint64_t value, uint64_t max)
+{
+    value = MIN(value, max);
+    uint32_t code = 0;
+    while (value)
+    {
+        value >>= 1;
+        code++;
+    }
+    return code;
+}
+
+void comux_cinfo_segment_set(comux_cinfo_t* cinfo, size_t size, uint32_t gap)
+{
+    cinfo->flags &= ~(COMUX_CHUNK_FLAGS_SEGMENT_MASK | COMUX_CHUNK_FLAGS_GAP_MASK);
+    cinfo->flags |= comux_segment_code(size, COMUX_CHUNK_SEGMENT_MAXLEN) <<
+                    COMUX_CHUNK_FLAGS_SEGMENT_SHIFT;
+    cinfo->flags |= comux_segment_code(gap, COMUX_CHUNK_GAP_MAX) <<
+                    COMUX_CHUNK_FLAGS_GAP_SHIFT;
+}
+
+uint64_t comux_cinfo_reset_offset(comux_cinfo_t* cinfo)
+{
+    uint64_t offset = (cinfo->flags & COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK) >>
+                      COMUX_CHUNK_FLAGS_RESET_OFFSET_SHIFT;
+    return offset == 0 || offset > cinfo->len ? cinfo->len : offset;
+}
+
+void comux_cinfo_reset_set(comux_cinfo_t* cinfo, uint64_t offset)
+{
+    offset = offset >= cinfo->len ? 0 : MIN(offset, COMUX_CHUNK_RESET_OFFSET_MAX);
+    cinfo->flags &= ~COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK;
+    cinfo->flags |= COMUX_CHUNK_FLAGS_RESET |
+                    ((uint32_t) offset << COMUX_CHUNK_FLAGS_RESET_OFFSET_SHIFT);
+}
+
+void comux_cinfo_reset_clear(comux_cinfo_t* cinfo)
+{
+    cinfo->flags &= ~(COMUX_CHUNK_FLAGS_RESET | COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK);
+}
+
+uint8_t comux_reset_offset_fits(uint64_t len, uint64_t offset)
+{
+    return offset == 0 || offset >= len || offset <= COMUX_CHUNK_RESET_OFFSET_MAX;
+}
+
 
 // ========================= The Main Comux Struct ========================= //
 void comux_manifest_init(comux_manifest_t* manifest)
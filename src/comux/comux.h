@@ -91,6 +91,7 @@ char* comux_parse_result_string(comux_parse_result_t result);
 // =========================== The Comux Header ============================ //
 #define COMUX_MAGIC_LEN 8
 #define COMUX_MAGIC "comux!!!"
+#define COMUX_HEADER_LEN 20 // size of the header on disk (magic + 3 u32s)
 
 // This struct defines the members of the comux header struct. The header is
 // written to the very beginning of the file, and is parsed to understand the
@@ -138,6 +139,7 @@ comux_parse_result_t comux_header_read_buffer(comux_header_t* header,
 
 // ======================== The Comux Chunk Header ========================= //
 #define COMUX_CHUNK_DATA_MAXLEN 524288
+#define COMUX_CINFO_HEADER_LEN 20 // size of a chunk header on disk
 
 // This enum defines a series of flags used for the 'flags' field in the cinfo
 // struct.
@@ -146,10 +148,41 @@ typedef enum comux_chunk_flags
     COMUX_CHUNK_FLAGS_NONE = 0x0,           // no flags
     COMUX_CHUNK_FLAGS_AWAIT_RESPONSE = 0x1, // wait for the server's response
     COMUX_CHUNK_FLAGS_NO_SHUTDOWN = 0x2,    // DON'T shutdown() socket write-end
+    COMUX_CHUNK_FLAGS_RESET = 0x4,          // reset the connection after this
+    COMUX_CHUNK_FLAGS_UPSTREAM = 0x8,       // sent BY the emulated upstream
     // -------------------------------
-    COMUX_CHUNK_FLAGS_ALL = 0x3             // ALL current flags
+    COMUX_CHUNK_FLAGS_ALL = 0xf             // ALL current flags
 } comux_chunk_flags_t;
 
+// Bits 8-15 of the flags field aren't on/off flags. They describe how a
+// chunk's data is split up ("segmented") as it's sent:
+//  - Bits 8-11 hold the segment size code. 0 means the data is sent all at
+//    once. Otherwise, the data is sent in separate writes of 2^(code-1) bytes
+//    (1 to 16384 bytes).
+//  - Bits 12-15 hold the gap code. 0 means no gap. Otherwise, the sender waits
+//    2^(code-1) microseconds (1 to 16384) between segments.
+#define COMUX_CHUNK_FLAGS_SEGMENT_SHIFT 8
+#define COMUX_CHUNK_FLAGS_SEGMENT_MASK (0xfu << COMUX_CHUNK_FLAGS_SEGMENT_SHIFT)
+#define COMUX_CHUNK_FLAGS_GAP_SHIFT 12
+#define COMUX_CHUNK_FLAGS_GAP_MASK (0xfu << COMUX_CHUNK_FLAGS_GAP_SHIFT)
+#define COMUX_CHUNK_SEGMENT_MAXLEN (1u << 14)
+#define COMUX_CHUNK_GAP_MAX (1u << 14)
+
+// Bits 16-31 of the flags field hold the reset offset, used along with the
+// RESET flag. 0 means the connection is reset after the entire chunk is sent.
+// Otherwise, it's reset after this many of the chunk's bytes have been sent.
+#define COMUX_CHUNK_FLAGS_RESET_OFFSET_SHIFT 16
+#define COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK \
+    (0xffffu << COMUX_CHUNK_FLAGS_RESET_OFFSET_SHIFT)
+#define COMUX_CHUNK_RESET_OFFSET_MAX 0xffffu
+
+// Every bit of the flags field that means something. Anything outside of this
+// is unsupported.
+#define COMUX_CHUNK_FLAGS_VALID (COMUX_CHUNK_FLAGS_ALL |            \
+                                 COMUX_CHUNK_FLAGS_SEGMENT_MASK |   \
+                                 COMUX_CHUNK_FLAGS_GAP_MASK |       \
+                                 COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK)
+
 // This struct defines all the information about a single chunk defined in
 // a comux file. A chunk represents a literal chunk of data to be sent to the
 // target server, with some extra metadata (such as *which* connection to send
@@ -223,6 +256,12 @@ ssize_t comux_cinfo_data_write_buffer(comux_cinfo_t* cinfo, char* buff,
 // and does not point to any heap-allocated memory.
 size_t comux_cinfo_data_read(comux_cinfo_t* cinfo, int fd);
 
+// Performs the same action as 'comux_cinfo_data_read', but uses pread() to read
+// the data segment from its offset within the file (as given by the cinfo's
+// 'offset' field). The file descriptor's own offset is left untouched, so
+// multiple threads may call this on the same file descriptor at once.
+size_t comux_cinfo_data_pread(comux_cinfo_t* cinfo, int fd);
+
 // Performs the same action as 'comux_cinfo_data_read', but instead reads from
 // a buffer of max length 'buff_len'.
 // If it returns less than cinfo->len, it's because the buffer enforced a
@@ -259,7 +298,41 @@ size_t comux_cinfo_data_read_buffer(comux_cinfo_t* cinfo, char* buff,
 
 // Simple macro to take the cinfo's offset and add the correct number to point
 // to the offset of the data segment.
-#define comux_cinfo_data_offset(cinfo) (((comux_cinfo_t*) cinfo)->offset + 20)
+#define comux_cinfo_data_offset(cinfo) \
+    (((comux_cinfo_t*) cinfo)->offset + COMUX_CINFO_HEADER_LEN)
+
+// Returns the number of bytes in each of the chunk's segments, based on its
+// flags. If 0 is returned, the chunk isn't segmented.
+size_t comux_cinfo_segment_size(comux_cinfo_t* cinfo);
+
+// Returns the number of microseconds to wait between each of the chunk's
+// segments, based on its flags.
+uint32_t comux_cinfo_segment_gap(comux_cinfo_t* cinfo);
+
+// Updates the chunk's flags to send its data in segments of 'size' bytes, with
+// a gap of 'gap' microseconds between them. Only powers of two can be encoded,
+// so both values are rounded down to one (and capped at the maximum). A 'size'
+// of 0 turns segmentation off, and a 'gap' of 0 removes the gap.
+void comux_cinfo_segment_set(comux_cinfo_t* cinfo, size_t size, uint32_t gap);
+
+// Returns the number of the chunk's bytes to send before resetting the
+// connection. This is only meaningful if the RESET flag is set. The chunk's
+// length is returned if the entire chunk is to be sent first.
+uint64_t comux_cinfo_reset_offset(comux_cinfo_t* cinfo);
+
+// Sets the chunk's RESET flag, so the connection is reset after 'offset' of
+// the chunk's bytes are sent. An 'offset' of 0 (or one that's beyond the end
+// of the chunk) resets the connection after the entire chunk. Offsets above
+// COMUX_CHUNK_RESET_OFFSET_MAX can't be encoded, and are capped.
+void comux_cinfo_reset_set(comux_cinfo_t* cinfo, uint64_t offset);
+
+// Clears the chunk's RESET flag, along with its reset offset.
+void comux_cinfo_reset_clear(comux_cinfo_t* cinfo);
+
+// Returns non-zero if a chunk of 'len' bytes can be reset after 'offset' of
+// its bytes exactly as asked. (Offsets inside the chunk that are above
+// COMUX_CHUNK_RESET_OFFSET_MAX would be capped by comux_cinfo_reset_set().)
+uint8_t comux_reset_offset_fits(uint64_t len, uint64_t offset);
 
 // ========================= The Main Comux Struct ========================= //
 // This struct, called the "manifest", represents the entire content of a comux
@@ -68,7 +68,7 @@ static char* clopts_descriptions[] =
     "(ARG=file_path) Specifies the output file to write to. (Output will go to stdout if not specified.)",
     "(ARG=conn_ID) Specifies the connection ID to set for a chunk (used with -c, -a, -e)",
     "(ARG=sched_value) Specifies the scheduling value to set for a chunk (used with -c, -a, -e)",
-    "(ARG=flags_value) Specifies the flags to set for a chunk (used with -c, -a, -e)",
+    "(ARG=flags_value) Specifies the flags to set for a chunk, comma-separated (AWAIT_RESPONSE, NO_SHUTDOWN, RESET, RESET=offset, UPSTREAM, SEGMENT=bytes, GAP=microseconds, or NONE) (used with -c, -a, -e)",
     "(ARG=num_conns) Sets a comux file's 'num_conns' header value.",
     "Enables verbose output. (Chunk data segments will be printed.)"
 };
@@ -169,10 +169,49 @@ static void parse_flags(char* val)
         { flag = COMUX_CHUNK_FLAGS_AWAIT_RESPONSE; }
         else if (!strcmp(flag_name, "NO_SHUTDOWN"))
         { flag = COMUX_CHUNK_FLAGS_NO_SHUTDOWN; }
+        else if (!strcmp(flag_name, "RESET"))
+        { flag = COMUX_CHUNK_FLAGS_RESET; }
+        else if (!strcmp(flag_name, "UPSTREAM"))
+        { flag = COMUX_CHUNK_FLAGS_UPSTREAM; }
+        else if (!strncmp(flag_name, "RESET=", 6))
+        {
+            // the reset offset takes a value, and is packed into the upper
+            // bits of the flags field
+            long value = 0;
+            if (str_to_int(flag_name + 6, &value) || value < 0 ||
+                value > COMUX_CHUNK_RESET_OFFSET_MAX)
+            {
+                fatality("the reset offset in \"%s\" must be between 0 and %u.",
+                         flag_name, COMUX_CHUNK_RESET_OFFSET_MAX);
+            }
+            flags &= ~COMUX_CHUNK_FLAGS_RESET_OFFSET_MASK;
+            flags |= (uint32_t) value << COMUX_CHUNK_FLAGS_RESET_OFFSET_SHIFT;
+            flag = COMUX_CHUNK_FLAGS_RESET;
+        }
+        else if (!strncmp(flag_name, "SEGMENT=", 8) ||
+                 !strncmp(flag_name, "GAP=", 4))
+        {
+            // segmentation settings take a value, and are packed into the
+            // upper bits of the flags field by the comux module
+            long value = 0;
+            if (str_to_int(strchr(flag_name, '=') + 1, &value) || value < 0)
+            { fatality("failed to parse a non-negative value from \"%s\".", flag_name); }
+
+            comux_cinfo_t tmp;
+            comux_cinfo_init(&tmp);
+            tmp.flags = flags;
+            if (flag_name[0] == 'S')
+            { comux_cinfo_segment_set(&tmp, value, comux_cinfo_segment_gap(&tmp)); }
+            else
+            { comux_cinfo_segment_set(&tmp, comux_cinfo_segment_size(&tmp), value); }
+            flags = tmp.flags;
+            comux_cinfo_free(&tmp);
+            flag = COMUX_CHUNK_FLAGS_SEGMENT_MASK; // (so we don't warn below)
+        }
 
         // OR the flag with the global flag field. If a flag wasn't actually
         // found, print a warning
-        flags |= flag;
+        flags |= flag & COMUX_CHUNK_FLAGS_ALL;
         if (!flag)
         { vprintf(stderr, C_GRAY "Warning: unknown flag: '%s'\n" C_NONE, flag_name); }
 
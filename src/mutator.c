@@ -7,6 +7,7 @@
 //      Connor Shugg
 
 // Module inclusions
+#define _GNU_SOURCE     // memmem
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -20,6 +21,8 @@
 #include "utils/utils.h"
 #include "utils/log.h"
 #include "utils/dict.h"
+#include "utils/arena.h"
+#include "utils/usdt.h"
 #include "mutator.h"
 
 // AFL++ inclusions
@@ -46,6 +49,9 @@ uint8_t debug_log = 0; // controlled by GURTHANG_ENV_MUT_DEBUG
 static uint32_t fuzz_min = 512; // min count of fuzzing attempts for an input
 #define GURTHANG_ENV_MUT_FUZZ_MAX "GURTHANG_MUT_FUZZ_MAX"
 static uint32_t fuzz_max = 32768; // max count of fuzzing attempts for an input
+#define GURTHANG_ENV_MUT_STACK_POW2 "GURTHANG_MUT_STACK_POW2"
+static uint32_t stack_pow2 = 4; // up to 2^N strategies stacked per fuzz
+static const uint32_t stack_pow2_max = 7; // largest allowed value for 'stack_pow2'
 
 // Trimming-related globals
 #define GURTHANG_ENV_MUT_TRIM_MAX "GURTHANG_MUT_TRIM_MAX"
@@ -82,6 +88,34 @@ typedef enum gurthang_mutate_strategy
     STRAT_UNKNOWN               // used as an 'uninitialized' value
 } gurthang_strategy_t;
 
+// AFL++ calls afl_custom_fuzz() hundreds or thousands of times in a row with
+// the same queue entry. Rather than re-parsing every header each time, the
+// mutator parses an input once into an index that records where each chunk
+// sits and what its (fixed-up) header fields are. Only the header bytes
+// decide how an input parses, so the index is reused for any input whose
+// length and header bytes match the ones it was built from.
+typedef struct gurthang_index_chunk
+{
+    uint32_t id;                // the chunk's connection ID
+    uint64_t len;               // length of the chunk's data in the input
+    uint32_t sched;             // the chunk's scheduling value
+    uint32_t flags;             // the chunk's flags (with fixups applied)
+    size_t header_offset;       // offset of the chunk's header in the input
+    size_t data_offset;         // offset of the chunk's data in the input
+    uint8_t pristine;           // '1' if the fixups didn't change the header
+} gurthang_index_chunk_t;
+
+typedef struct gurthang_index
+{
+    uint8_t valid;              // '1' if the index holds a parsed input
+    size_t buff_len;            // length of the input it was built from
+    comux_header_t header;      // the input's parsed comux header
+    uint8_t header_pristine;    // '1' if the header needed no fixups
+    gurthang_index_chunk_t* chunks; // one entry per chunk, in file order
+    uint32_t chunks_cap;        // number of entries 'chunks' has room for
+    buffer_t headers;           // copy of the input's raw header bytes
+} gurthang_index_t;
+
 // A single struct used to carry around all the metadata for this mutator.
 typedef struct gurthang_mutator
 {
@@ -104,6 +138,19 @@ typedef struct gurthang_mutator
 
     // Fuzzing settings
     gurthang_strategy_t strat; // the current fuzzing strategy
+    uint32_t last_strats;      // strategies the latest fuzz used (1 << strat)
+    uint32_t last_stack_len;   // number of strategies the latest fuzz stacked
+    gurthang_index_t index;    // the most recently parsed input
+
+    // Per-fuzz memory. Chunk data starts out as a view into AFL++'s input
+    // buffer, and is only copied (into a spare buffer) once a strategy wants
+    // to write to it
+    arena_t arena;          // scratch memory, reset at the start of each fuzz
+    char* in_buff;          // the input currently being fuzzed
+    size_t in_len;          // ...and its length
+    buffer_t* spares;       // data buffers not in use by any chunk
+    uint32_t spares_len;    // number of entries in 'spares'
+    uint32_t spares_cap;    // number of entries 'spares' has room for
     uint32_t last_fuzz_count; // latest retval from afl_custom_fuzz_count
 
     #if defined(GURTHANG_MUT_HAVOC_SUPPORT)
@@ -210,6 +257,24 @@ static void PFX(init_environment_variables)()
 
     }
 
+    // check for the stack-power variable. This controls how many strategies
+    // can be stacked onto one another in a single fuzzing run
+    char* env_stack = getenv(GURTHANG_ENV_MUT_STACK_POW2);
+    if (env_stack)
+    {
+        log_write(&mlog, "found %s=%s.", GURTHANG_ENV_MUT_STACK_POW2, env_stack);
+
+        // attempt to convert to an integer
+        long conversion = 0;
+        if (str_to_int(env_stack, &conversion) || conversion < 0 ||
+            conversion > (long) stack_pow2_max)
+        { fatality("%s must be an integer in [0, %u].", env_stack, stack_pow2_max); }
+
+        stack_pow2 = (uint32_t) conversion;
+        log_write(&mlog, STAB_TREE1 "up to %u strategies will be stacked per fuzz.",
+                  1u << stack_pow2);
+    }
+
     // check for the max-trim variable. This controls the maximum number of trim
     // steps for a single trimming stage
     char* env_tmax = getenv(GURTHANG_ENV_MUT_TRIM_MAX);
@@ -304,13 +369,250 @@ static char* PFX(check_comux_cinfo)(comux_header_t* header, comux_cinfo_t* cinfo
 
     // make a bitmask to AND with the flags field to see if there are any
     // unsupported flags specified
-    uint32_t mask = ~((uint32_t) COMUX_CHUNK_FLAGS_ALL);
+    uint32_t mask = ~((uint32_t) COMUX_CHUNK_FLAGS_VALID);
     if (cinfo->flags & mask)
     { return "unsupported flag bits are enabled"; }
 
     return NULL;
 }
 
+// Parses the given comux input into the given index, applying the same fixups
+// afl_custom_fuzz() always has (invalid flags and NO_SHUTDOWN are masked off,
+// and data segments are capped to what's actually in the buffer). Returns
+// NULL on success, or an error message on failure (the index is then left
+// invalid).
+static char* PFX(index_build)(gurthang_index_t* index, char* buff, size_t buff_len)
+{
+    index->valid = 0;
+    buffer_reset(&index->headers);
+
+    // parse and check the comux header
+    size_t total_rcount = 0;
+    size_t rcount = 0;
+    comux_header_init(&index->header);
+    comux_parse_result_t pr = comux_header_read_buffer(&index->header, buff,
+                                                       buff_len, &rcount);
+    if (pr)
+    { return comux_parse_result_string(pr); }
+    char* emsg = PFX(check_comux_header)(&index->header);
+    if (emsg)
+    { return emsg; }
+    index->header_pristine = index->header.version == 0;
+    buffer_appendn(&index->headers, buff, rcount);
+    total_rcount += rcount;
+
+    // make sure we have room for every chunk
+    uint32_t num_chunks = index->header.num_chunks;
+    if (num_chunks > index->chunks_cap)
+    {
+        index->chunks = realloc_check(index->chunks,
+                                      sizeof(gurthang_index_chunk_t) * num_chunks);
+        index->chunks_cap = num_chunks;
+    }
+
+    // parse and check each chunk header, then skip past its data
+    for (uint32_t i = 0; i < num_chunks; i++)
+    {
+        comux_cinfo_t cinfo;
+        comux_cinfo_init(&cinfo);
+        pr = comux_cinfo_read_buffer(&cinfo, buff + total_rcount,
+                                     buff_len - total_rcount, &rcount);
+        if (pr)
+        { return comux_parse_result_string(pr); }
+
+        // fix up the flags such that any unsupported bits are NOT enabled,
+        // then check the rest of the header
+        uint32_t raw_flags = cinfo.flags;
+        cinfo.flags = cinfo.flags & COMUX_CHUNK_FLAGS_VALID;
+        emsg = PFX(check_comux_cinfo)(&index->header, &cinfo);
+        if (emsg)
+        { return emsg; }
+
+        // force-disable the NO_SHUTDOWN flag. This will cause hangs when
+        // handled by the preload library, which AFL++ would flag. We don't
+        // want any false-positive hangs.
+        cinfo.flags = cinfo.flags & ~COMUX_CHUNK_FLAGS_NO_SHUTDOWN;
+
+        gurthang_index_chunk_t* chunk = &index->chunks[i];
+        chunk->header_offset = total_rcount;
+        buffer_appendn(&index->headers, buff + total_rcount, rcount);
+        total_rcount += rcount;
+
+        // the data segment can't be longer than what's left in the buffer
+        // (or than a chunk is allowed to be)
+        chunk->id = cinfo.id;
+        chunk->sched = cinfo.sched;
+        chunk->flags = cinfo.flags;
+        chunk->data_offset = total_rcount;
+        chunk->len = MIN(cinfo.len, (uint64_t) COMUX_CHUNK_DATA_MAXLEN);
+        chunk->len = MIN(chunk->len, (uint64_t) (buff_len - total_rcount));
+        chunk->pristine = cinfo.flags == raw_flags && chunk->len == cinfo.len;
+        total_rcount += chunk->len;
+    }
+
+    // hard-set the version number
+    index->header.version = 0;
+    index->buff_len = buff_len;
+    index->valid = 1;
+    return NULL;
+}
+
+// Returns 1 if the given input parses exactly like the one the index was
+// built from: that is, if it's the same length and every header byte is the
+// same. (Data bytes don't matter.) Returns 0 otherwise.
+static uint8_t PFX(index_matches)(gurthang_index_t* index, char* buff, size_t buff_len)
+{
+    if (!index->valid || index->buff_len != buff_len)
+    { return 0; }
+
+    char* saved = buffer_dptr(&index->headers);
+    if (memcmp(buff, saved, COMUX_HEADER_LEN))
+    { return 0; }
+    saved += COMUX_HEADER_LEN;
+    for (uint32_t i = 0; i < index->header.num_chunks; i++)
+    {
+        if (memcmp(buff + index->chunks[i].header_offset, saved,
+                   COMUX_CINFO_HEADER_LEN))
+        { return 0; }
+        saved += COMUX_CINFO_HEADER_LEN;
+    }
+    return 1;
+}
+
+// Makes sure the mutator's index describes the given input, re-building it if
+// it doesn't. Returns NULL on success and an error message on failure.
+static char* PFX(index_get)(gurthang_mut_t* mut, char* buff, size_t buff_len)
+{
+    if (PFX(index_matches)(&mut->index, buff, buff_len))
+    {
+        dlog_write(&mlog, STAB_TREE2 "reusing the parsed input index.");
+        return NULL;
+    }
+    return PFX(index_build)(&mut->index, buff, buff_len);
+}
+
+// Points the given chunk's data at the given bytes, without copying them.
+// Chunks like this are "views" into the input buffer, and must be made
+// writable with PFX(cinfo_own) before anything modifies their data.
+static void PFX(cinfo_view)(comux_cinfo_t* cinfo, char* data, size_t len)
+{
+    cinfo->data.data = data;
+    cinfo->data.size = len;
+    cinfo->data.cap = 0;
+    cinfo->len = len;
+}
+
+// Returns 1 if the chunk's data is a view into the input buffer.
+static uint8_t PFX(cinfo_is_view)(gurthang_mut_t* mut, comux_cinfo_t* cinfo)
+{
+    char* data = buffer_dptr(&cinfo->data);
+    return data >= mut->in_buff && data <= mut->in_buff + mut->in_len;
+}
+
+// Hands out an empty data buffer, reusing a spare one if there are any.
+static buffer_t PFX(buffer_take)(gurthang_mut_t* mut)
+{
+    buffer_t buff;
+    if (mut->spares_len > 0)
+    {
+        buff = mut->spares[--mut->spares_len];
+        buffer_reset(&buff);
+    }
+    else
+    { buffer_init(&buff, 1 << 10); }
+    return buff;
+}
+
+// Makes the given chunk's data writable. If it's a view into the input
+// buffer, its bytes are copied into a buffer of its own.
+static void PFX(cinfo_own)(gurthang_mut_t* mut, comux_cinfo_t* cinfo)
+{
+    if (!PFX(cinfo_is_view)(mut, cinfo))
+    { return; }
+    buffer_t buff = PFX(buffer_take)(mut);
+    buffer_appendn(&buff, buffer_dptr(&cinfo->data), buffer_size(&cinfo->data));
+    cinfo->data = buff;
+}
+
+// Takes back the data buffers of every chunk that owns one, so the next fuzz
+// can reuse them.
+static void PFX(cinfos_release)(gurthang_mut_t* mut, comux_cinfo_t* cinfos,
+                                uint32_t cinfos_len)
+{
+    for (uint32_t i = 0; i < cinfos_len; i++)
+    {
+        comux_cinfo_t* cinfo = &cinfos[i];
+        if (!buffer_dptr(&cinfo->data) || PFX(cinfo_is_view)(mut, cinfo))
+        { continue; }
+        if (mut->spares_len == mut->spares_cap)
+        {
+            mut->spares_cap = mut->spares_cap ? mut->spares_cap << 1 : 8;
+            mut->spares = realloc_check(mut->spares,
+                                        sizeof(buffer_t) * mut->spares_cap);
+        }
+        mut->spares[mut->spares_len++] = cinfo->data;
+        cinfo->data.data = NULL;
+    }
+}
+
+// When writing out a fuzzed comux file, anything that wasn't changed is
+// copied straight out of the input buffer. Consecutive unchanged pieces of
+// the input are collected into a "run" and copied with a single memcpy().
+typedef struct gurthang_out_run
+{
+    char* start;                // start of the run in the input buffer
+    size_t len;                 // number of bytes in the run
+} gurthang_out_run_t;
+
+// Appends the given bytes to the mutator's output buffer, as long as the
+// output stays within 'max_len'. Returns 0 on success and -1 if there's no
+// room.
+static int PFX(out_append)(gurthang_mut_t* mut, char* src, size_t len, size_t max_len)
+{
+    if (len > max_len - buffer_size(&mut->buff))
+    { return -1; }
+    memcpy(buffer_nptr(&mut->buff), src, len);
+    buffer_size_increase(&mut->buff, len);
+    return 0;
+}
+
+// Copies out the pending run (if there is one) and empties it. Returns 0 on
+// success and -1 if there's no room.
+static int PFX(out_flush)(gurthang_mut_t* mut, gurthang_out_run_t* run, size_t max_len)
+{
+    int result = run->len ? PFX(out_append)(mut, run->start, run->len, max_len) : 0;
+    run->len = 0;
+    return result;
+}
+
+// Adds the given piece of the input buffer to the pending run. If it doesn't
+// pick up right where the run ends, the run is copied out first and a new
+// one is started. Returns 0 on success and -1 if there's no room.
+static int PFX(out_region)(gurthang_mut_t* mut, gurthang_out_run_t* run,
+                           char* src, size_t len, size_t max_len)
+{
+    if (run->len && run->start + run->len == src)
+    {
+        run->len += len;
+        return 0;
+    }
+    int result = PFX(out_flush)(mut, run, max_len);
+    run->start = src;
+    run->len = len;
+    return result;
+}
+
+// Returns 1 if the given chunk's header would be written out exactly as it
+// appears in the input, at the given index entry. ('chunk' is NULL for a chunk
+// a mutation created.)
+static uint8_t PFX(cinfo_header_clean)(gurthang_index_chunk_t* chunk,
+                                       comux_cinfo_t* cinfo)
+{
+    return chunk && chunk->pristine &&
+           cinfo->id == chunk->id && cinfo->len == chunk->len &&
+           cinfo->sched == chunk->sched && cinfo->flags == chunk->flags;
+}
+
 // Helper function invoked by 'afl_custom_fuzz' when a badly-formatted comux
 // file is read that cannot be fixed. Uses bytes from the original input buffer
 // to create an entirely new comux file, writing it to a buffer and setting
@@ -321,6 +623,8 @@ static size_t PFX(make_new_comux)(gurthang_mut_t* mut, char* buff, size_t buff_l
     dlog_write(&mlog, STAB_TREE1 "%shandling bad comux file.%s",
                LOG_NOT_USING_FILE(&mlog) ? C_BAD : "",
                LOG_NOT_USING_FILE(&mlog) ? C_NONE : "");
+    mut->last_strats = 1u << STRAT_FIXUP;
+    mut->last_stack_len = 1;
 
     // TODO: this would only be needed if someone decides to run this mutator
     // and preload library with with AFL++'s built-in mutations enabled (in
@@ -416,12 +720,13 @@ static uint8_t PFX(find_cinfo_sched_bounds)(comux_cinfo_t* cinfos, uint32_t cinf
 // Helper function called by 'afl_custom_fuzz' with a chunk info struct whose
 // data has been parsed and saved into memory. This function is responsible for
 // performing random mutations on JUST the cinfo's data segment.
-static void PFX(mutate_cinfo_data_havoc)(comux_cinfo_t* cinfo)
+static void PFX(mutate_cinfo_data_havoc)(gurthang_mut_t* mut, comux_cinfo_t* cinfo)
 {
     // if the chunk has NOTHING in it, don't bother
     if (cinfo->len == 0)
     { return; }
 
+    PFX(cinfo_own)(mut, cinfo);
     surgical_havoc_mutate((u8*) buffer_dptr(&cinfo->data), 0,
                           buffer_size(&cinfo->data));
 }
@@ -429,12 +734,13 @@ static void PFX(mutate_cinfo_data_havoc)(comux_cinfo_t* cinfo)
 // Helper functio called by 'afl_custom_fuzz' with a cinfo struct to be
 // mutated. This implements some "extra" havoc-like mutations not implemented
 // by AFL++.
-static void PFX(mutate_cinfo_data_extra)(comux_cinfo_t* cinfo)
+static void PFX(mutate_cinfo_data_extra)(gurthang_mut_t* mut, comux_cinfo_t* cinfo)
 {
     // if the chunk has NOTHING in it, don't bother
     if (cinfo->len == 0)
     { return; }
 
+    PFX(cinfo_own)(mut, cinfo);
     char* data = buffer_dptr(&cinfo->data);
     size_t data_len = buffer_size(&cinfo->data);
 
@@ -450,18 +756,14 @@ static void PFX(mutate_cinfo_data_extra)(comux_cinfo_t* cinfo)
                 // random index at which to select bytes
                 size_t reverse_size = RAND_UNDER(cinfo->len);
                 ssize_t reverse_idx = RAND_UNDER(cinfo->len - reverse_size);
-                char tmp[reverse_size];
 
-                // copy the bytes, in reverse order, into the temporary buffer
-                size_t tmp_idx = 0;
-                for (ssize_t i = reverse_idx + reverse_size - 1;
-                     i >= reverse_idx; i--)
-                { tmp[tmp_idx++] = data[i]; }
-
-                // write the reversed bytes into the correct spots in the
-                // original chunk buffer
-                for (ssize_t i = 0; i < reverse_size; i++)
-                { data[i + reverse_idx] = tmp[i]; }
+                // swap bytes from both ends of the range, working inwards
+                for (size_t i = 0; i < reverse_size / 2; i++)
+                {
+                    char tmp = data[reverse_idx + i];
+                    data[reverse_idx + i] = data[reverse_idx + reverse_size - 1 - i];
+                    data[reverse_idx + reverse_size - 1 - i] = tmp;
+                }
 
                 dlog_write(&mlog, STAB_TREE3 STAB_TREE1 "reversed bytes %lu-%lu.",
                            reverse_idx, reverse_idx + reverse_size - 1);
@@ -563,7 +865,7 @@ static int64_t PFX(mutate_cinfo_sched_bump)(comux_header_t* header,
 // and the original chunk's data segment will be split between itself and the
 // chunk pointed at by 'new_cinfo'.
 // On failure, -1 is returned.
-static int64_t PFX(mutate_cinfo_split)(comux_header_t* header,
+static int64_t PFX(mutate_cinfo_split)(gurthang_mut_t* mut, comux_header_t* header,
                                        comux_cinfo_t* cinfos, uint32_t cinfos_len,
                                        comux_cinfo_t* new_cinfo)
 {
@@ -604,22 +906,26 @@ static int64_t PFX(mutate_cinfo_split)(comux_header_t* header,
     // next, we'll take the select chunk and split its data into two
     uint64_t split_index = RAND_UNDER(cinfos[index].len - 1) + 1;
     uint64_t datalens[2] = {split_index, cinfos[index].len - split_index};
-    char split_left[datalens[0] + 1];
-    char split_right[datalens[1] + 1];
-    snprintf(split_left, datalens[0] + 1, "%s", buffer_dptr(&cinfos[index].data));
-    snprintf(split_right, datalens[1] + 1, "%s", buffer_dptr(&cinfos[index].data) + datalens[0]);
+    char* split_right = buffer_dptr(&cinfos[index].data) + datalens[0];
+    uint64_t reset_at = comux_cinfo_reset_offset(&cinfos[index]);
 
     dlog_write(&mlog, STAB_TREE3 STAB_TREE2
                "splitting chunk %u (data_len=%lu) (split_data_lens=[%lu, %lu]).",
                index, cinfos[index].len, datalens[0], datalens[1]);
 
-    // copy over the right-side split of the bytes into the new cinfo's data
+    // if the chunk is still a view into the input, both halves can be views
+    // too. Otherwise, the right-side split gets copied into a buffer of its
+    // own. Either way, the old cinfo just keeps the left-side split
     comux_cinfo_init(new_cinfo);
-    comux_cinfo_data_appendn(new_cinfo, split_right, datalens[1]);
-    // reset the old cinfo's buffer and re-write the left-side split into it
-    buffer_reset(&cinfos[index].data);
-    cinfos[index].len = 0;
-    comux_cinfo_data_appendn(&cinfos[index], split_left, datalens[0]);
+    if (PFX(cinfo_is_view)(mut, &cinfos[index]))
+    { PFX(cinfo_view)(new_cinfo, split_right, datalens[1]); }
+    else
+    {
+        new_cinfo->data = PFX(buffer_take)(mut);
+        comux_cinfo_data_appendn(new_cinfo, split_right, datalens[1]);
+    }
+    cinfos[index].data.size = datalens[0];
+    cinfos[index].len = datalens[0];
 
     // next we need to find two scheduling values for the old and new cinfos
     // such that they maintain the ordering between themselves AND the other
@@ -637,8 +943,10 @@ static int64_t PFX(mutate_cinfo_split)(comux_header_t* header,
     dlog_write(&mlog, STAB_TREE3 STAB_TREE1
                "new scheduling values: [%u, %u]", cinfos[index].sched, new_cinfo->sched);
 
-    // adjust a few other fields
+    // adjust a few other fields. Both halves of an UPSTREAM chunk are still
+    // upstream responses
     new_cinfo->id = cinfos[index].id;
+    new_cinfo->flags |= cinfos[index].flags & COMUX_CHUNK_FLAGS_UPSTREAM;
     if (cinfos[index].flags & COMUX_CHUNK_FLAGS_AWAIT_RESPONSE)
     {
         // if the original chunk had the 'AWAIT_RESPONSE' flag set, we want
@@ -647,6 +955,13 @@ static int64_t PFX(mutate_cinfo_split)(comux_header_t* header,
         cinfos[index].flags ^= COMUX_CHUNK_FLAGS_AWAIT_RESPONSE;
         new_cinfo->flags |= COMUX_CHUNK_FLAGS_AWAIT_RESPONSE;
     }
+    if ((cinfos[index].flags & COMUX_CHUNK_FLAGS_RESET) && reset_at > datalens[0])
+    {
+        // if the original chunk reset the connection somewhere in what's now
+        // the new chunk's data, the new chunk needs to do the resetting
+        comux_cinfo_reset_clear(&cinfos[index]);
+        comux_cinfo_reset_set(new_cinfo, reset_at - datalens[0]);
+    }
      
     return index + 1;
 }
@@ -660,7 +975,7 @@ static int64_t PFX(mutate_cinfo_split)(comux_header_t* header,
 // On sucess, one chunk will be modified to hold both its own data and the
 // spliced chunk's data, and the index of the spliced chunk (the one to remove)
 // is returned.
-static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
+static int64_t PFX(mutate_cinfo_splice)(gurthang_mut_t* mut, comux_header_t* header,
                                         comux_cinfo_t* cinfos, uint32_t cinfos_len)
 {
     // if there aren't enough chunks, return
@@ -671,7 +986,8 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
     // for us to perform this mutation (we need at least two chunks belonging
     // to the same connection). So first, we'll find connection IDs that are
     // valid.
-    int64_t cid_counts[header->num_conns];
+    int64_t* cid_counts = arena_alloc(&mut->arena,
+                                      sizeof(int64_t) * header->num_conns);
     for (int64_t i = 0; i < (int64_t) header->num_conns; i++)
     { cid_counts[i] = 0; }
     for (uint32_t i = 0; i < cinfos_len; i++)
@@ -704,7 +1020,8 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
 
     // now we'll build an array of indexes of chunks that belong to our
     // selected connection
-    uint32_t conn_indexes[cid_counts[cid]];
+    uint32_t* conn_indexes = arena_alloc(&mut->arena,
+                                         sizeof(uint32_t) * cid_counts[cid]);
     uint32_t conn_indexes_len = 0;
     for (uint32_t i = 0; i < cinfos_len; i++)
     {
@@ -718,6 +1035,31 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
     uint32_t pair_index = RAND_UNDER(conn_indexes_len - 1);
     uint32_t pair[2] = {conn_indexes[pair_index], conn_indexes[pair_index + 1]};
 
+    // an UPSTREAM chunk and a chunk sent to the server travel in opposite
+    // directions, so they can't be spliced together
+    if ((cinfos[pair[0]].flags ^ cinfos[pair[1]].flags) & COMUX_CHUNK_FLAGS_UPSTREAM)
+    { return -1; }
+
+    // if either chunk resets the connection, the spliced chunk has to reset it
+    // at the same point. If pair[0] already reset the connection, pair[1]'s
+    // data was never sent, so we keep pair[0]'s reset where it was. Otherwise
+    // pair[1]'s reset moves along with its data. If the new offset is too big
+    // to encode, the reset would move, so these chunks can't be spliced
+    uint64_t pair0_len = cinfos[pair[0]].len;
+    uint64_t spliced_len = pair0_len + cinfos[pair[1]].len;
+    uint64_t reset_at = 0;
+    if (cinfos[pair[0]].flags & COMUX_CHUNK_FLAGS_RESET)
+    { reset_at = comux_cinfo_reset_offset(&cinfos[pair[0]]); }
+    else if (cinfos[pair[1]].flags & COMUX_CHUNK_FLAGS_RESET)
+    { reset_at = pair0_len + comux_cinfo_reset_offset(&cinfos[pair[1]]); }
+    if (!comux_reset_offset_fits(spliced_len, reset_at))
+    {
+        dlog_write(&mlog, STAB_TREE3 STAB_TREE1
+                   "chunks %u and %u can't be spliced: the reset offset "
+                   "(%lu) is too large.", pair[0], pair[1], reset_at);
+        return -1;
+    }
+
     dlog_write(&mlog, STAB_TREE3 STAB_TREE2
                "selected chunks %u and %u (conn_id=%u) for splicing.",
                pair[0], pair[1], cid);
@@ -730,6 +1072,7 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
     // and are adjacent to each other (excluding chunks from other
     // connections). Now, we'll take pair[1]'s data and append it onto
     // pair[0]'s data
+    PFX(cinfo_own)(mut, &cinfos[pair[0]]);
     comux_cinfo_data_appendn(&cinfos[pair[0]], buffer_dptr(&cinfos[pair[1]].data),
                              buffer_size(&cinfos[pair[1]].data));
     // if pair[1]'s flags have the AWAIT_RESPONSE flag enabled, we want to copy
@@ -737,6 +1080,9 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
     // to pair[0]'s.
     if (cinfos[pair[1]].flags & COMUX_CHUNK_FLAGS_AWAIT_RESPONSE)
     { cinfos[pair[0]].flags |= COMUX_CHUNK_FLAGS_AWAIT_RESPONSE; }
+    // the same goes for a RESET (at the offset we worked out above)
+    if ((cinfos[pair[0]].flags | cinfos[pair[1]].flags) & COMUX_CHUNK_FLAGS_RESET)
+    { comux_cinfo_reset_set(&cinfos[pair[0]], reset_at); }
     
     // return the index of pair[1], the chunk we now want to delete
     return pair[1];
@@ -747,7 +1093,8 @@ static int64_t PFX(mutate_cinfo_splice)(comux_header_t* header,
 // found, it's swapped for a different word in the same dictionary, and 0 is
 // returned to indicate success. If one can't be found, a non-zero value is
 // returned instead.
-static uint8_t PFX(mutate_cinfo_dict_swap)(comux_cinfo_t* cinfos, uint32_t cinfos_len)
+static uint8_t PFX(mutate_cinfo_dict_swap)(gurthang_mut_t* mut,
+                                           comux_cinfo_t* cinfos, uint32_t cinfos_len)
 {
     uint32_t index = RAND_UNDER(cinfos_len);
     uint32_t count = 0;
@@ -776,9 +1123,11 @@ static uint8_t PFX(mutate_cinfo_dict_swap)(comux_cinfo_t* cinfos, uint32_t cinfo
             while (cnt < dict->size)
             {
                 // search the chunk's data for the current dictionary entry. If
-                // it's found, save the offset and the entry and break
+                // it's found, save the offset and the entry and break. (The
+                // data may be a view into the input, so it isn't necessarily
+                // null-terminated)
                 dict_entry_t* de = &dict->entries[idx];
-                char* ptr = strstr(data, de->str);
+                char* ptr = memmem(data, data_len, de->str, de->len);
                 if (ptr)
                 {
                     dentry = de;
@@ -803,16 +1152,18 @@ static uint8_t PFX(mutate_cinfo_dict_swap)(comux_cinfo_t* cinfos, uint32_t cinfo
 
             // make a copy of all the bytes *after* the original keyword
             size_t copy_len = data_len - (dentry_offset + dentry->len);
-            char copy[copy_len];
+            char* copy = arena_alloc(&mut->arena, copy_len);
             if (copy_len > 0)
             { memcpy(copy, data + dentry_offset + dentry->len, copy_len); }
 
             // now, reset the chunk buffer's size manually back to where we
             // want it, and write in the key dictionary entry word plus the
             // bytes that occurrred after it
+            PFX(cinfo_own)(mut, cinfo);
             cinfo->data.size = dentry_offset;
             buffer_appendn(&cinfo->data, swap->str, swap->len);
             buffer_appendn(&cinfo->data, copy, copy_len);
+            cinfo->len = buffer_size(&cinfo->data);
             
             // success - log and return
             dlog_write(&mlog, STAB_TREE3 STAB_TREE1
@@ -896,11 +1247,11 @@ static void PFX(mutate_cinfos)(gurthang_mut_t* mut, comux_header_t* header,
     switch (strat)
     {
         case STRAT_CHUNK_DATA_HAVOC:
-            PFX(mutate_cinfo_data_havoc)(&cinfos[RAND_UNDER(header->num_chunks)]);
+            PFX(mutate_cinfo_data_havoc)(mut, &cinfos[RAND_UNDER(header->num_chunks)]);
             buffer_appendf(&mut->dbuff, "chunk_havoc");
             break;
         case STRAT_CHUNK_DATA_EXTRA:
-            PFX(mutate_cinfo_data_extra)(&cinfos[RAND_UNDER(header->num_chunks)]);
+            PFX(mutate_cinfo_data_extra)(mut, &cinfos[RAND_UNDER(header->num_chunks)]);
             buffer_appendf(&mut->dbuff, "chunk_extra");
             break;
         case STRAT_CHUNK_SCHED_BUMP:
@@ -918,7 +1269,7 @@ static void PFX(mutate_cinfos)(gurthang_mut_t* mut, comux_header_t* header,
             break;
         case STRAT_CHUNK_SPLIT:
             // try to find a chunk and split it. Try something else on failure
-            *new_cinfo_index = PFX(mutate_cinfo_split)(header, cinfos, cinfos_len, new_cinfo);
+            *new_cinfo_index = PFX(mutate_cinfo_split)(mut, header, cinfos, cinfos_len, new_cinfo);
             if (*new_cinfo_index == -1)
             {
                 free_strats[STRAT_CHUNK_SPLIT]++;
@@ -932,7 +1283,7 @@ static void PFX(mutate_cinfos)(gurthang_mut_t* mut, comux_header_t* header,
         case STRAT_CHUNK_SPLICE:
             // try to find a chunk to splice, and splice it. Try something else
             // on failure
-            *delete_cinfo_index = PFX(mutate_cinfo_splice)(header, cinfos, cinfos_len);
+            *delete_cinfo_index = PFX(mutate_cinfo_splice)(mut, header, cinfos, cinfos_len);
             if (*delete_cinfo_index == -1)
             {
                 free_strats[STRAT_CHUNK_SPLICE]++;
@@ -945,7 +1296,7 @@ static void PFX(mutate_cinfos)(gurthang_mut_t* mut, comux_header_t* header,
             break;
         case STRAT_CHUNK_DICT_SWAP:
             // attempt to mutate a single chunk - on failure, try another strat
-            if (PFX(mutate_cinfo_dict_swap)(cinfos, cinfos_len))
+            if (PFX(mutate_cinfo_dict_swap)(mut, cinfos, cinfos_len))
             {
                 free_strats[STRAT_CHUNK_DICT_SWAP]++;
                 strat = gurthang_strategy_choose(header, free_strats);
@@ -958,11 +1309,13 @@ static void PFX(mutate_cinfos)(gurthang_mut_t* mut, comux_header_t* header,
         default:
             // if, for some reason, we have a case not specified above, we'll
             // just perform a havoc mutation on a chunk's data
-            PFX(mutate_cinfo_data_havoc)(&cinfos[RAND_UNDER(header->num_chunks)]);
+            PFX(mutate_cinfo_data_havoc)(mut, &cinfos[RAND_UNDER(header->num_chunks)]);
             break;
     }
     
-    // reset the mutator's 'strat' field for the next fuzz
+    // note down the strategy we ended up using (it's stacked with the others),
+    // and reset the mutator's 'strat' field for the next fuzz
+    mut->last_strats |= 1u << strat;
     mut->strat = STRAT_UNKNOWN;
 }
 
@@ -991,7 +1344,19 @@ gurthang_mut_t* afl_custom_init(afl_state_t* afl, unsigned int seed)
 
     // set up initial fuzzing options
     mut->strat = STRAT_UNKNOWN;
+    mut->last_strats = 0;
+    mut->last_stack_len = 0;
     mut->last_fuzz_count = 0;
+    mut->index.valid = 0;
+    mut->index.chunks = NULL;
+    mut->index.chunks_cap = 0;
+    buffer_init(&mut->index.headers, 1 << 12);
+    arena_init(&mut->arena, 1 << 16);
+    mut->in_buff = NULL;
+    mut->in_len = 0;
+    mut->spares = NULL;
+    mut->spares_len = 0;
+    mut->spares_cap = 0;
 
     #if defined(GURTHANG_MUT_HAVOC_SUPPORT)
     mut->havoc_probability = 100;
@@ -1025,6 +1390,12 @@ void afl_custom_deinit(gurthang_mut_t* mut)
     buffer_free(&mut->tbuff_head);
     buffer_free(&mut->tbuff_tail);
     buffer_free(&mut->tbuff);
+    buffer_free(&mut->index.headers);
+    free(mut->index.chunks);
+    arena_free(&mut->arena);
+    for (uint32_t i = 0; i < mut->spares_len; i++)
+    { buffer_free(&mut->spares[i]); }
+    free(mut->spares);
 
     // free any dictionaries
     while (dlist.size > 0)
@@ -1044,9 +1415,9 @@ void afl_custom_deinit(gurthang_mut_t* mut)
 //  - addbuff_len    the length of the additional buffer
 //  - max_len       the maximum length of outbuff can hold
 // This returns the number of bytes written to outbuff.
-size_t afl_custom_fuzz(gurthang_mut_t* mut, char* buff, size_t buff_len,
-                       char** outbuff, char* addbuff, size_t addbuff_len,
-                       size_t max_len)
+static size_t PFX(fuzz)(gurthang_mut_t* mut, char* buff, size_t buff_len,
+                        char** outbuff, char* addbuff, size_t addbuff_len,
+                        size_t max_len)
 {
     #if defined(GURTHANG_MUT_MEMCHECK)
     // periodically perform memory leak checks
@@ -1073,84 +1444,53 @@ size_t afl_custom_fuzz(gurthang_mut_t* mut, char* buff, size_t buff_len,
     flog_write(&mlog, "fuzzing test case: buff_len=%lu, max_len=%lu",
                buff_len, max_len);
 
-    // set up variables for reading/parsing (and clear our reusable buffer)
-    size_t total_rcount = 0;
-    size_t rcount = 0;
+    // clear our reusable buffer and scratch memory
     ssize_t wcount = 0;
     buffer_reset(&mut->buff);
-
-    // ----------------------- COMUX HEADER PARSING ------------------------ //
-    // first, try to parse the header from the buffer
-    comux_header_t header;
-    comux_header_init(&header);
-    comux_parse_result_t pr = comux_header_read_buffer(&header, buff, buff_len, &rcount);
-    if (pr)
-    {
-        dlog_write(&mlog, STAB_TREE2 "failed to read the header: %s.",
-                   comux_parse_result_string(pr));
-        return PFX(make_new_comux)(mut, buff, buff_len, outbuff, max_len);
-    }
-    total_rcount += rcount;
-
-    // perform a series of checks on the parsed header
-    char* emsg = PFX(check_comux_header)(&header);
+    arena_reset(&mut->arena);
+    mut->in_buff = buff;
+    mut->in_len = buff_len;
+
+    // ------------------------ COMUX INPUT PARSING ------------------------ //
+    // look up the input in our index (or parse it, if it isn't the one we
+    // saw last). If it can't be parsed, we'll build a new comux file instead
+    char* emsg = PFX(index_get)(mut, buff, buff_len);
     if (emsg)
     {
-        dlog_write(&mlog, STAB_TREE2 "found an issue with the header: %s.",
-                   emsg);
+        dlog_write(&mlog, STAB_TREE2 "failed to parse the input: %s.", emsg);
         return PFX(make_new_comux)(mut, buff, buff_len, outbuff, max_len);
     }
-
-    // hard-set the version number
-    header.version = 0;
-
-    // ------------------------ COMUX CHUNK PARSING ------------------------ //
-    // next, try to iterate through each chunk and read each comux chunk
+    comux_header_t header = mut->index.header;
+
+    // Like AFL++'s own havoc stage, we stack several strategies on top of one
+    // another before writing the result out once. The stack size is a random
+    // power of two. (If a specific strategy was requested, only it is used.)
+    uint32_t stack_len = 1;
+    if (mut->strat == STRAT_UNKNOWN && stack_pow2 > 0)
+    { stack_len = 1u << RAND_UNDER(stack_pow2 + 1); }
+    mut->last_stack_len = stack_len;
+
+    // set up each chunk from its index entry. The chunk data isn't copied;
+    // each chunk starts out as a view into the input buffer. Every split adds
+    // a chunk, so we make room for one more chunk per stacked strategy.
+    // Alongside each chunk we keep its entry in the index (or NULL for chunks
+    // created by a mutation), which lets the writer below figure out what's
+    // still unchanged from the input
     uint32_t num_chunks = header.num_chunks;
-    comux_cinfo_t cinfos[num_chunks];
+    comux_cinfo_t* cinfos = arena_alloc(&mut->arena,
+                                        sizeof(comux_cinfo_t) * (num_chunks + stack_len));
+    gurthang_index_chunk_t** origins =
+        arena_alloc(&mut->arena, sizeof(gurthang_index_chunk_t*) * (num_chunks + stack_len));
     for (uint32_t i = 0; i < num_chunks; i++)
     {
         comux_cinfo_t* cinfo = &cinfos[i];
-        // initialize and attempt to read the cinfo header data
+        gurthang_index_chunk_t* chunk = &mut->index.chunks[i];
+        origins[i] = chunk;
         comux_cinfo_init(cinfo);
-        comux_parse_result_t pr;
-        pr = comux_cinfo_read_buffer(cinfo,
-                                     buff + total_rcount,
-                                     MAX(0, (ssize_t) buff_len - (ssize_t) total_rcount),
-                                     &rcount);
-        // if reading of the current cinfo header failed, log and handle
-        if (pr)
-        {
-            dlog_write(&mlog, STAB_TREE1 "failed to read chunk %u: %s.",
-                       i, comux_parse_result_string(pr));
-            return PFX(make_new_comux)(mut, buff, buff_len, outbuff, max_len);
-        }
-        total_rcount += rcount;
-
-        // fix up the flags such that any unsupported bits are NOT enabled,
-        // then perform a few more checks to ensure the chunk header looks ok
-        cinfo->flags = cinfo->flags & COMUX_CHUNK_FLAGS_ALL;
-        emsg = PFX(check_comux_cinfo)(&header, cinfo);
-        if (emsg)
-        {
-            dlog_write(&mlog, STAB_TREE2 "found an issue with chunk %u: %s.",
-                       i, emsg);
-            return PFX(make_new_comux)(mut, buff, buff_len, outbuff, max_len);
-        }
-
-        // force-disable the NO_SHUTDOWN flag, if applicable. This will cause
-        // hangs when handled by the preload library, which AFL++ would flag. We
-        // don't want any false-positive hangs.
-        cinfo->flags = cinfo->flags & ~COMUX_CHUNK_FLAGS_NO_SHUTDOWN;
-
-        // read the cinfo's data into its buffer
-        rcount = comux_cinfo_data_read_buffer(cinfo, buff + total_rcount,
-                                              MAX(0, (ssize_t) buff_len - (ssize_t) total_rcount));
-        total_rcount += rcount;
-
-        // update the data length if the number of bytes we just read doesn't
-        // match the chunk's 'len' field
-        cinfo->len = cinfo->len == rcount ? cinfo->len : rcount;
+        cinfo->id = chunk->id;
+        cinfo->sched = chunk->sched;
+        cinfo->flags = chunk->flags;
+        PFX(cinfo_view)(cinfo, buff + chunk->data_offset, chunk->len);
     }
 
     // ------------------------ COMUX CHUNK FUZZING ------------------------ //
@@ -1159,113 +1499,146 @@ size_t afl_custom_fuzz(gurthang_mut_t* mut, char* buff, size_t buff_len,
     // if a crash/hang is detected and AFL++ invokes afl_custom_describe().)
     buffer_reset(&mut->dbuff);
     buffer_appendf(&mut->dbuff, "ss_");
-    // set up a few needed fields (used to adding/removing cinfos) then invoke
-    // the main mutation function
+    // apply each of the stacked strategies in turn
+    dlog_write(&mlog, STAB_TREE2 "stacking %u strateg%s.",
+               stack_len, stack_len == 1 ? "y" : "ies");
     comux_cinfo_t new_cinfo;
-    int64_t new_cinfo_index = -1;
-    int64_t delete_cinfo_index = -1;
-    PFX(mutate_cinfos)(mut, &header, cinfos, num_chunks,
-                       &new_cinfo, &new_cinfo_index, &delete_cinfo_index);
-    
-    // depending on what was specified, we'll increase or decrease the number
-    // of chunks specified by the header before we write it out
-    if (new_cinfo_index > -1)
-    { header.num_chunks++; }
-    else if (delete_cinfo_index > -1)
-    { header.num_chunks--; }
+    comux_cinfo_init(&new_cinfo);
+    for (uint32_t s = 0; s < stack_len; s++)
+    {
+        // set up a few needed fields (used to adding/removing cinfos) then
+        // invoke the main mutation function
+        int64_t new_cinfo_index = -1;
+        int64_t delete_cinfo_index = -1;
+        if (s > 0)
+        { buffer_appendf(&mut->dbuff, "+"); }
+        PFX(mutate_cinfos)(mut, &header, cinfos, num_chunks,
+                           &new_cinfo, &new_cinfo_index, &delete_cinfo_index);
+
+        // depending on what was specified, we'll insert or remove a chunk and
+        // adjust the number of chunks specified by the header, so the next
+        // strategy sees the chunks as they are now
+        if (new_cinfo_index > -1)
+        {
+            uint32_t at = (uint32_t) new_cinfo_index;
+            memmove(&cinfos[at + 1], &cinfos[at], sizeof(comux_cinfo_t) * (num_chunks - at));
+            memmove(&origins[at + 1], &origins[at],
+                    sizeof(gurthang_index_chunk_t*) * (num_chunks - at));
+            cinfos[at] = new_cinfo;
+            origins[at] = NULL;
+            comux_cinfo_init(&new_cinfo);
+            num_chunks++;
+        }
+        else if (delete_cinfo_index > -1)
+        {
+            uint32_t at = (uint32_t) delete_cinfo_index;
+            PFX(cinfos_release)(mut, &cinfos[at], 1);
+            memmove(&cinfos[at], &cinfos[at + 1], sizeof(comux_cinfo_t) * (num_chunks - at - 1));
+            memmove(&origins[at], &origins[at + 1],
+                    sizeof(gurthang_index_chunk_t*) * (num_chunks - at - 1));
+            num_chunks--;
+        }
+        header.num_chunks = num_chunks;
+    }
     
     // ----------------------- COMUX HEADER WRITING ------------------------ //
-    // write the header out to our output buffer
-    wcount = comux_header_write_buffer(&header, buffer_nptr(&mut->buff), max_len);
-    if (wcount < 0)
+    // write the header out to our output buffer. Anything that's the same as
+    // it was in the input (which is usually most of it) is collected into
+    // runs and copied straight out of the input buffer
+    gurthang_out_run_t run = {.start = NULL, .len = 0};
+    if (mut->index.header_pristine &&
+        header.num_chunks == mut->index.header.num_chunks)
     {
-        dlog_write(&mlog, STAB_TREE1 "not enough buffer space to write the header. "
-                   "No mutations done.");
-        // return the exact same buffer that was given as input
-        *outbuff = buff;
-        return buff_len;
+        if (PFX(out_region)(mut, &run, buff, COMUX_HEADER_LEN, max_len))
+        { goto no_room; }
+    }
+    else
+    {
+        wcount = comux_header_write_buffer(&header, buffer_nptr(&mut->buff), max_len);
+        if (wcount < 0)
+        { goto no_room; }
+        buffer_size_increase(&mut->buff, wcount);
     }
-    buffer_size_increase(&mut->buff, wcount);
 
     // ------------------------ COMUX CHUNK WRITING ------------------------ //
-    // iterate, again, through the chunks, and write them out. We iterate one
-    // extra time (one more than the number of chunks) in case we need to
-    // insert a new chunk at the very end.
-    for (uint32_t i = 0; i < num_chunks + 1; i++)
+    // iterate, again, through the chunks, and write them out
+    for (uint32_t i = 0; i < num_chunks; i++)
     {
-        comux_cinfo_t* cinfo = NULL;
-        // if there isn't a new chunk to insert at the end, skip the final
-        // iteration. Otherwise, we'll just grab the current chunk as usual
-        uint8_t new_cinfo_match = new_cinfo_index > -1 && (uint32_t) new_cinfo_index == i;
-        if (i == num_chunks)
-        {
-            if (!new_cinfo_match)
-            { continue; }
-        }
-        else
-        { cinfo = &cinfos[i]; } // grab current chunk
-
-        // if we were given a chunk index to "delete" from the mutation above,
-        // and we just hit that index, we'll skip this iteration entirely to
-        // prevent the chunk from getting written out (effectively deleting it)
-        if (cinfo && delete_cinfo_index > -1 && (uint32_t) delete_cinfo_index == i)
-        {
-            comux_cinfo_free(cinfo);
-            continue;
-        }
-
-        // if we were given an index to insert a new chunk, check for that here
-        if (new_cinfo_match)
-        { cinfo = &new_cinfo; }
+        comux_cinfo_t* cinfo = &cinfos[i];
 
-        // write the header out to the output buffer
-        wcount = comux_cinfo_write_buffer(cinfo, buffer_nptr(&mut->buff),
-                                          max_len - buffer_size(&mut->buff));
-        if (wcount < 0)
+        // write the header out to the output buffer. If it's unchanged, it
+        // joins the current run. Otherwise the run is flushed and only the
+        // header itself is re-encoded
+        if (PFX(cinfo_header_clean)(origins[i], cinfo))
         {
-            dlog_write(&mlog, STAB_TREE1 "not enough buffer space to write chunk "
-                       "%u's header. No mutations done.", i);
-            // return the exact same buffer that was given as input
-            *outbuff = buff;
-            return buff_len;
+            if (PFX(out_region)(mut, &run, mut->in_buff + origins[i]->header_offset,
+                                COMUX_CINFO_HEADER_LEN, max_len))
+            { goto no_room; }
         }
-        buffer_size_increase(&mut->buff, wcount);
-
-        // then, attempt to write the data out to the output buffer
-        wcount = comux_cinfo_data_write_buffer(cinfo, buffer_nptr(&mut->buff),
-                                               max_len - buffer_size(&mut->buff));
-        if (wcount < 0)
+        else
         {
-            dlog_write(&mlog, STAB_TREE1 "not enough buffer space to write chunk "
-                       "%u's data. No mutations done.", i);
-            // return the exact same buffer that was given as input
-            *outbuff = buff;
-            return buff_len;
+            if (PFX(out_flush)(mut, &run, max_len))
+            { goto no_room; }
+            wcount = comux_cinfo_write_buffer(cinfo, buffer_nptr(&mut->buff),
+                                              max_len - buffer_size(&mut->buff));
+            if (wcount < 0)
+            { goto no_room; }
+            buffer_size_increase(&mut->buff, wcount);
         }
-        buffer_size_increase(&mut->buff, wcount);
-        
-        // free the chunk's memory
-        comux_cinfo_free(cinfo);
 
-        // if this iteration was the writing-out of a new cinfo (added via a
-        // mutation), back the iterator up and reset the 'new_cinfo_index' so
-        // we can write-out cinfos[i]
-        if (new_cinfo_match)
+        // then, write the data out. If it's still a view into the input, it
+        // can join the run as well
+        if (PFX(cinfo_is_view)(mut, cinfo))
         {
-            i--;
-            new_cinfo_index = -1;
+            if (PFX(out_region)(mut, &run, buffer_dptr(&cinfo->data),
+                                cinfo->len, max_len))
+            { goto no_room; }
         }
+        else if (PFX(out_flush)(mut, &run, max_len) ||
+                 PFX(out_append)(mut, buffer_dptr(&cinfo->data), cinfo->len,
+                                 max_len))
+        { goto no_room; }
     }
+    if (PFX(out_flush)(mut, &run, max_len))
+    { goto no_room; }
 
     // we reached the end with no issues - log it
     dlog_write(&mlog, STAB_TREE1 "%sall good!%s",
                LOG_NOT_USING_FILE(&mlog) ? C_GOOD : "",
                LOG_NOT_USING_FILE(&mlog) ? C_NONE : "");
     
-    // point the outbuff pointer to the correct spot, and return the correct
-    // size of the fuzzed data
+    // take back any chunk data buffers, then point the outbuff pointer to the
+    // correct spot, and return the correct size of the fuzzed data
+    PFX(cinfos_release)(mut, cinfos, num_chunks);
+    PFX(cinfos_release)(mut, &new_cinfo, 1);
     *outbuff = buffer_dptr(&mut->buff);
     return buffer_size(&mut->buff);
+
+no_room:
+    // if we couldn't fit the output under 'max_len', return the exact same
+    // buffer that was given as input
+    dlog_write(&mlog, STAB_TREE1 "not enough buffer space to write the "
+               "output. No mutations done.");
+    PFX(cinfos_release)(mut, cinfos, num_chunks);
+    PFX(cinfos_release)(mut, &new_cinfo, 1);
+    *outbuff = buff;
+    return buff_len;
+}
+
+// AFL++'s entry point for the function above. It's split out so the tracing
+// probes see every return path, including the ones that fall back to
+// building a brand new comux file.
+size_t afl_custom_fuzz(gurthang_mut_t* mut, char* buff, size_t buff_len,
+                       char** outbuff, char* addbuff, size_t addbuff_len,
+                       size_t max_len)
+{
+    GURTHANG_PROBE2(fuzz_entry, buff_len, max_len);
+    mut->last_strats = 0;
+    mut->last_stack_len = 0;
+    size_t result = PFX(fuzz)(mut, buff, buff_len, outbuff,
+                              addbuff, addbuff_len, max_len);
+    GURTHANG_PROBE3(fuzz_exit, result, mut->last_stack_len, mut->last_strats);
+    return result;
 }
 
 #if defined(GURTHANG_MUT_HAVOC_SUPPORT)
@@ -1404,37 +1777,21 @@ unsigned int afl_custom_fuzz_count(gurthang_mut_t* mut, char* buff, size_t buff_
     flog_write(&mlog, "inspecting input (previous fuzz count: %u)",
                current_fuzz_count);
     
-    // set up counters for reading the buffer
-    size_t total_rcount = 0;
-    size_t rcount = 0;
-
-    // attempt to parse the comux header from the buffer. We'll use this to
-    // determine how interesting the test case might be
-    comux_header_t header;
-    comux_header_init(&header);
-    comux_parse_result_t pr = comux_header_read_buffer(&header, buff, buff_len, &rcount);
-    // if parsing failed, there's something wrong with the comux file, so we
-    // don't want to fuzz it as much. Reduce the count
-    if (pr)
-    {
-        dlog_write(&mlog, STAB_TREE1 "failed to parse the comux header: %s. "
-                   "Reducing. (%u --> %u)", comux_parse_result_string(pr),
-                   current_fuzz_count, reduced_fuzz_count);
-        mut->last_fuzz_count = reduced_fuzz_count;
-        return reduced_fuzz_count;
-    }
-    total_rcount += rcount;
-
-    // perform a few checks of the header. If they fail, we'll reduce
-    char* emsg = PFX(check_comux_header)(&header);
+    // parse the input into the mutator's index. We'll use this to determine
+    // how interesting the test case might be, and the fuzzing calls that
+    // follow for this input will reuse it. If parsing failed, there's
+    // something wrong with the comux file, so we don't want to fuzz it as
+    // much. Reduce the count
+    char* emsg = PFX(index_build)(&mut->index, buff, buff_len);
     if (emsg)
     {
-        dlog_write(&mlog, STAB_TREE1 "found an issue with the header: %s. "
+        dlog_write(&mlog, STAB_TREE1 "failed to parse the comux file: %s. "
                    "Reducing. (%u --> %u)",
                    emsg, current_fuzz_count, reduced_fuzz_count);
         mut->last_fuzz_count = reduced_fuzz_count;
         return reduced_fuzz_count;
     }
+    comux_header_t header = mut->index.header;
 
     // if this comux input has multiple connections specified within it, that's
     // interesting! Multiple connections could lead to more concurrency-related
@@ -1453,46 +1810,6 @@ unsigned int afl_custom_fuzz_count(gurthang_mut_t* mut, char* buff, size_t buff_
         dlog_write(&mlog, STAB_TREE2 "only one connection specified.");
     }
 
-    // next, we'll try to read each cinfo header and check for issues
-    comux_cinfo_t cinfo;
-    for (uint32_t i = 0; i < header.num_chunks; i++)
-    {
-        // initialize and attempt to read the cinfo header data
-        comux_cinfo_init(&cinfo);
-        comux_parse_result_t pr;
-        pr = comux_cinfo_read_buffer(&cinfo,
-                                     buff + total_rcount,
-                                     MAX(0, (ssize_t) buff_len - (ssize_t) total_rcount),
-                                     &rcount);
-        
-        // if reading of the current cinfo header failed, we'll reduce
-        if (pr)
-        {
-            dlog_write(&mlog, STAB_TREE1 "failed to read chunk %u: %s. "
-                       "Reducing. (%u --> %u)",
-                       i, comux_parse_result_string(pr),
-                       current_fuzz_count, reduced_fuzz_count);
-            mut->last_fuzz_count = reduced_fuzz_count;
-            return reduced_fuzz_count;
-        }
-        total_rcount += rcount;
-
-        // perform a series of checks for the cinfo's header information
-        emsg = PFX(check_comux_cinfo)(&header, &cinfo);
-        if (emsg)
-        {
-            dlog_write(&mlog, STAB_TREE1 "found an issue with chunk %u: %s. "
-                       "Reducing. (%u --> %u)",
-                       i, emsg, current_fuzz_count, reduced_fuzz_count);
-            mut->last_fuzz_count = reduced_fuzz_count;
-            return reduced_fuzz_count;
-        }
-
-        // skip to the next comux chunk header, according to the current one's
-        // data length field
-        total_rcount += cinfo.len;
-    }
-
     // if this comux input has lots of chunks, that's interesting! Multiple
     // chunks could mean we have messages split up across several chunks,
     // which may lead to some interesting bugs in the target server
@@ -1522,6 +1839,10 @@ unsigned int afl_custom_fuzz_count(gurthang_mut_t* mut, char* buff, size_t buff_
 // based on what mutations this mutator performed.
 char* afl_custom_describe(gurthang_mut_t* mut, size_t max_len)
 {
+    // a long stack of strategies can make for a long description, so cut it
+    // off if it won't fit (it's rebuilt on the next fuzz anyway)
+    if (max_len > 0 && buffer_size(&mut->dbuff) >= max_len)
+    { buffer_dptr(&mut->dbuff)[max_len - 1] = '\0'; }
     return buffer_dptr(&mut->dbuff);
 }
 
@@ -1677,6 +1998,7 @@ int afl_custom_init_trim(gurthang_mut_t* mut, char* buff, size_t buff_len)
                mut->trim_steps,
                mut->trim_steps == trim_steps_max ? " (capped)" : "",
                mut->trim_bytes_per_step);
+    GURTHANG_PROBE2(trim_init, mut->trim_steps, mut->trim_bytes_per_step);
     return mut->trim_steps;
 }
 
@@ -1772,6 +2094,8 @@ size_t afl_custom_trim(gurthang_mut_t* mut, char** outbuff)
                "Trimmed chunk down to %lu bytes.",
                buffer_size(&mut->trim_cinfo_old.data) - byte_counter,
                buffer_size(&mut->trim_cinfo.data));
+    GURTHANG_PROBE3(trim_step, mut->trim_count, old_size,
+                    buffer_size(&mut->tbuff));
     *outbuff = buffer_dptr(&mut->tbuff);
     return buffer_size(&mut->tbuff);
 }
@@ -1802,6 +2126,7 @@ int afl_custom_post_trim(gurthang_mut_t* mut, uint8_t success)
     mut->trim_count++;
     mut->trim_succeeded = success;
     mut->trim_success_count += success ? 1 : 0;
+    GURTHANG_PROBE2(trim_result, mut->trim_count, success);
 
     // compute how far along we are and whether or not it's time to check how
     // successful trimming has been (we'll need this below). We'll stop to
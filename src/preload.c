@@ -14,19 +14,37 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <signal.h>
+#include <stdatomic.h>
 // System call injection includes
 #define __USE_GNU 1     // dlsym: required for RTLD_NEXT
 #include <dlfcn.h>      // dlsym: required for function definition
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>   // memfd_create (needs __USE_GNU)
+#include <poll.h>       // POLLRDHUP (needs __USE_GNU)
+#include <sys/random.h>
+#include <stdarg.h>
+#include <semaphore.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
 // My includes
 #include "comux/comux.h"
 #include "utils/utils.h"
 #include "utils/log.h"
+#include "utils/usdt.h"
 
 
 // ========================== Globals and Macros =========================== //
 #define GURTHANG_LIB // indicates that we're compiling the library
-#define CHUNKS_MAX 1 << 13 // maximum number of chunks
 #define PFX(name) __gurthang_lib_##name // to create library symbol names
 #define COPFX "[C] " // prefix for controller thread logging
 #define CHPFX "[CHK-%u] " // a prefix for each chunk thread
@@ -46,8 +64,18 @@ static int (*real_accept4) (int, struct sockaddr*, socklen_t*, int);
 static int(*real_listen) (int, int);
 static int (*real_epoll_ctl) (int, int, int, struct epoll_event*);
 static int (*real_epoll_wait) (int, struct epoll_event*, int, int);
-static int accept_sock; // the server's connection-accepting socket
-static int controller_initialized = 0;
+static int (*real_epoll_pwait) (int, struct epoll_event*, int, int,
+                                const sigset_t*);
+#if __GLIBC_PREREQ(2, 35)
+static int (*real_epoll_pwait2) (int, struct epoll_event*, int,
+                                 const struct timespec*, const sigset_t*);
+#endif
+static long (*real_syscall) (long, ...);
+static int (*real_connect) (int, const struct sockaddr*, socklen_t);
+static int (*real_bind) (int, const struct sockaddr*, socklen_t);
+static int (*real_close) (int);
+static int accept_sock = -1; // the server's connection-accepting socket
+static atomic_int controller_initialized = 0; // once-flag for the controller
 
 // Send/receive tuning
 #define GURTHANG_ENV_LIB_SEND_BUFFSIZE "GURTHANG_LIB_SEND_BUFFSIZE"
@@ -57,19 +85,200 @@ static const size_t chunk_thread_write_max_buffsize = 1 << 19;
 static size_t chunk_thread_read_buffsize = 2048; // default recv() buffer size
 static const size_t chunk_thread_read_max_buffsize = 1 << 19;
 
+// Chunk thread pool tuning
+#define GURTHANG_ENV_LIB_MAX_THREADS "GURTHANG_LIB_MAX_THREADS"
+static size_t chunk_pool_max_threads = 64; // default chunk thread pool size
+static const size_t chunk_pool_max_max_threads = 1 << 12;
+
+// File descriptor limit tuning
+#define FD_LIMIT_HEADROOM 256 // extra FDs we allow for beyond the comux conns
+
+// Most chunks we'll accept when stdin's size can't be checked (such as when
+// it's a pipe). This matches the mutator's MAX_CHUNKS
+#define STDIN_MAX_CHUNKS (1 << 13)
+
+// Connection hygiene. Our connections are torn down with a reset rather than
+// a FIN, so neither end sits in TIME_WAIT, and connect() is retried (within
+// reason) when it fails for reasons that tend to clear up on their own
+#define GURTHANG_ENV_LIB_PORT_RANGE "GURTHANG_LIB_PORT_RANGE"
+#define CONNECT_RETRY_MAX 8         // connect() attempts before giving up
+#define CONNECT_RETRY_DELAY_US 100  // initial retry delay (doubles each time)
+static uint16_t port_range_lo = 0; // source port range (0 = let the kernel
+static uint16_t port_range_hi = 0; // pick an ephemeral port)
+static atomic_uint port_range_next = 0; // next port to try, within the range
+static atomic_uint connect_failures = 0; // failed connect() attempts
+
 // Exit tuning
 #define GURTHANG_ENV_LIB_EXIT_IMMEDIATE "GURTHANG_LIB_EXIT_IMMEDIATE"
 static uint8_t exit_immediate = 0;
 
-// Servers using epoll to monitor the listener socket
-static int epoll_fd = -1; // epoll FD tied to the accept socket FD
+// Coverage windowing
+#define GURTHANG_ENV_LIB_COVERAGE_RESET "GURTHANG_LIB_COVERAGE_RESET"
+static uint8_t coverage_reset = 0;
+
+// Performance feedback (see the "Performance Feedback" section)
+#define GURTHANG_ENV_LIB_PERF_FEEDBACK "GURTHANG_LIB_PERF_FEEDBACK"
+#define GURTHANG_ENV_LIB_PERF_FEEDBACK_CPU "GURTHANG_LIB_PERF_FEEDBACK_CPU"
+static uint8_t perf_feedback = 0;
+static uint8_t perf_feedback_cpu = 0;
+static _Atomic uint64_t perf_max_latency = 0; // slowest response (us)
+
+// Memory feedback and cap (see the "Memory Feedback" section)
+#define GURTHANG_ENV_LIB_MEM_FEEDBACK "GURTHANG_LIB_MEM_FEEDBACK"
+#define GURTHANG_ENV_LIB_MEM_CAP_MB "GURTHANG_LIB_MEM_CAP_MB"
+#define MEM_MONITOR_INTERVAL_US 1000 // how often the memory cap is checked
+static uint8_t mem_feedback = 0;
+static size_t mem_cap_mb = 0; // 0 means there's no cap
+static const size_t mem_cap_max_mb = 1 << 20;
+static atomic_int mem_monitor_running = 0;
+
+// Leak sentinel (see the "Leak Sentinel" section)
+#define GURTHANG_ENV_LIB_LEAK_THRESHOLD "GURTHANG_LIB_LEAK_THRESHOLD"
+#define LEAK_SETTLE_TRIES 20    // times to re-count before calling it a leak
+#define LEAK_SETTLE_US 2500     // time to wait between each re-count
+static size_t leak_threshold = 0; // 0 means the sentinel is off
+static const size_t leak_max_threshold = 1 << 20;
+
+// Trace output (see the "Trace Output" section)
+#define GURTHANG_ENV_LIB_TRACE "GURTHANG_LIB_TRACE"
+static char* trace_path = NULL; // NULL means tracing is off
+
+// Response drainer (see the "Response Drainer" section)
+#define GURTHANG_ENV_LIB_DRAIN "GURTHANG_LIB_DRAIN"
+static uint8_t drain_enabled = 0;
+
+// TLS bypass (see the "TLS Interposition" section at the bottom)
+#define GURTHANG_ENV_LIB_TLS_BYPASS "GURTHANG_LIB_TLS_BYPASS"
+static uint8_t tls_bypass = 0;
+static struct sockaddr_storage tls_listen_addr; // the listener's local address
+static socklen_t tls_listen_addr_len = 0;
+
+// Upstream emulator (see the "Upstream Emulator" section)
+#define GURTHANG_ENV_LIB_UPSTREAM "GURTHANG_LIB_UPSTREAM"
+#define GURTHANG_ENV_LIB_UPSTREAM_RESPONSE "GURTHANG_LIB_UPSTREAM_RESPONSE"
+#define UPSTREAM_MAX_ADDRS 16 // number of upstream addresses we'll emulate
+#define UPSTREAM_RESPONSE_MAXLEN (1 << 20) // cap on the response file's size
+static struct sockaddr_in upstream_addrs[UPSTREAM_MAX_ADDRS];
+static uint32_t upstream_addrs_len = 0;
+static char* upstream_response = NULL; // contents of the response file
+static size_t upstream_response_len = 0;
+
+// Port remapping (see the "Port Remapping" section at the bottom)
+#define GURTHANG_ENV_LIB_BIND_REMAP "GURTHANG_LIB_BIND_REMAP"
+#define BIND_REMAP_MAX 16 // number of "FROM:TO" pairs we'll take
+typedef struct bind_remap
+{
+    int32_t from;               // port to remap (or BIND_REMAP_ANY)
+    uint16_t to;                // port to bind instead (0 for ephemeral)
+} bind_remap_t;
+static bind_remap_t bind_remaps[BIND_REMAP_MAX];
+static uint32_t bind_remaps_len = 0;
+
+// Determinism layer (see the "Determinism Layer" section at the bottom)
+#define GURTHANG_ENV_LIB_DETERMINISM "GURTHANG_LIB_DETERMINISM"
+#define GURTHANG_ENV_LIB_DETERMINISM_PID "GURTHANG_LIB_DETERMINISM_PID"
+static uint8_t det_enabled = 0;
+static uint8_t det_pid_enabled = 0;
+static uint64_t det_seed = 0;
+
+// Multi-process (prefork) servers. With GURTHANG_LIB_MULTI_PROCESS set, the
+// first process to call listen() maps a region of shared memory that every
+// process it forks will inherit. Whichever process gets there first is elected
+// to run the controller, and it uses the semaphore to tell the first process
+// when the exec is over (see the "Multi-Process Support" section).
+#define GURTHANG_ENV_LIB_MULTI_PROCESS "GURTHANG_LIB_MULTI_PROCESS"
+#define AFL_FORKSRV_STATUS_FD 199 // AFL's fork server status pipe (FORKSRV_FD + 1)
+static uint8_t mp_enabled = 0;
+typedef struct gurthang_mp_region
+{
+    atomic_int controller_elected;  // once-flag, shared by every process
+    sem_t exec_done;                // posted by the controller's process
+} mp_region_t;
+static mp_region_t* mp_region = NULL;
+static uint8_t mp_is_root = 0; // set in the process that called listen()
+static pid_t mp_fork_parent = 0; // PID of the process that last called fork()
+static atomic_int mp_watcher_spawned = 0;
 
 // Chunk thread locals
 static __thread uint32_t chunk_thread_id = 0; // for chunk thread logging
 static __thread uint8_t chunk_thread_is_final = 0; // for a conn's final chunk
+static __thread uint64_t chunk_thread_sent_at = 0; // when the chunk was sent
+static __thread uint32_t chunk_thread_sched = 0; // the chunk's sched value
 
 // Thread synchronization
-static pthread_mutex_t alock = PTHREAD_MUTEX_INITIALIZER; // for accept() calls
+static pthread_mutex_t alock = PTHREAD_MUTEX_INITIALIZER; // for PFX(init)
+
+// Logging can be compiled out of the chunk and controller threads entirely by
+// defining GURTHANG_LIB_NO_LOG (see the 'preload-nolog' makefile target). The
+// format arguments for these messages are evaluated on every call, even when
+// no log file is set, so this is worth doing for raw exec speed. (With logging
+// compiled out, the macros still reference their arguments from a dead branch,
+// so values computed only for a log message don't trigger unused warnings.)
+#ifdef GURTHANG_LIB_NO_LOG
+#define GURTHANG_LIB_LOG_ENABLED 0
+#else
+#define GURTHANG_LIB_LOG_ENABLED 1
+#endif
+
+
+// ========================= File Descriptor Sets ========================== //
+// A simple bitmap with one bit per file descriptor. Lookups, additions, and
+// removals are all lock-free, so these are safe to consult from the hooks we
+// place on the server's hot paths. File descriptors beyond the set's length
+// are simply never members.
+typedef struct fd_set_bitmap
+{
+    _Atomic uint64_t* bits;     // one bit per file descriptor
+    uint32_t len;               // number of file descriptors covered
+} fdset_t;
+
+#define FDSET_MAXLEN (1 << 20) // we won't track file descriptors beyond this
+
+// Initializes the set to cover every file descriptor the process is allowed to
+// open (up to FDSET_MAXLEN).
+static void PFX(fdset_init)(fdset_t* set)
+{
+    struct rlimit rl;
+    rlim_t len = FDSET_MAXLEN;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_max != RLIM_INFINITY)
+    { len = MIN(rl.rlim_max, FDSET_MAXLEN); }
+
+    size_t words = (len + 63) / 64;
+    set->bits = alloc_check(sizeof(uint64_t) * words);
+    memset(set->bits, 0, sizeof(uint64_t) * words);
+    set->len = len;
+}
+
+// Adds a file descriptor to the set.
+static inline void PFX(fdset_add)(fdset_t* set, int fd)
+{
+    if (fd < 0 || fd >= set->len)
+    { return; }
+    atomic_fetch_or_explicit(&set->bits[fd / 64], 1ull << (fd % 64),
+                             memory_order_relaxed);
+}
+
+// Removes a file descriptor from the set.
+static inline void PFX(fdset_remove)(fdset_t* set, int fd)
+{
+    if (fd < 0 || fd >= set->len)
+    { return; }
+    atomic_fetch_and_explicit(&set->bits[fd / 64], ~(1ull << (fd % 64)),
+                              memory_order_relaxed);
+}
+
+// Returns non-zero if the given file descriptor is in the set.
+static inline uint8_t PFX(fdset_has)(fdset_t* set, int fd)
+{
+    if (fd < 0 || fd >= set->len)
+    { return 0; }
+    return (atomic_load_explicit(&set->bits[fd / 64], memory_order_relaxed) >>
+            (fd % 64)) & 0x1;
+}
+
+// The set of epoll file descriptors watching the listener socket. Servers with
+// one epoll instance per worker thread add the listener to each of them.
+static fdset_t epoll_fds;
 
 
 // ===================== Active Connection Management ====================== //
@@ -80,6 +289,7 @@ typedef enum connection_table_entry_status
     CONN_STATUS_DEAD = 0,           // no connection exists
     CONN_STATUS_ALIVE = 1,          // a connection is active
     CONN_STATUS_CLOSED_REMOTE = 2,  // the target server closed the connection
+    CONN_STATUS_CLOSED_LOCAL = 3,   // we reset the connection (RESET flag)
 } ctable_status_t;
 
 // Simple struct that contains an integer, representing a socket file
@@ -89,811 +299,3800 @@ typedef struct connection_table_entry
 {
     int fd;                     // the connection file descriptor
     ctable_status_t status;     // the status of this entry
+    atomic_int drain_owner;     // see the "Response Drainer" section
 } ctable_entry_t;
 
 // The active-connection table. A simple array that, given a connection ID from
 // a comux chunk header (0, 1, 2, etc.), one can look up the currently-opened
-// file descriptor for that particular connection.
-#define CTABLE_MAXLEN 1 << 12                   // maximum entries
-static ctable_entry_t ctable[CTABLE_MAXLEN];    // global table of connections
-static pthread_mutex_t ctable_lock;             // table lock
+// file descriptor for that particular connection. It's allocated by the
+// controller thread once it knows how many connections the comux file has.
+static ctable_entry_t* ctable = NULL;   // global table of connections
+static uint32_t ctable_len = 0;         // number of entries in the table
+static pthread_mutex_t ctable_lock;     // table lock
 
+// Closes one of our connections. Every connection has SO_LINGER set with a
+// zero timeout when it's created (see PFX(chunk_connect)), so this is a reset
+// rather than a normal close. A normal close() leaves whichever end closed
+// first in TIME_WAIT for a minute or so, and at hundreds of execs per second
+// those pile up until loopback runs out of ports.
+static void PFX(conn_close)(int sockfd)
+{ close(sockfd); }
 
-// ============================== Chunk Thead ============================== //
-// Used to pass in all the necessary data for a single chunk thread.
-typedef struct chunk_thread_parameters
+// Returns non-zero if the server has already closed its end of the given
+// connection. There's no point in shutting down our write-end after that, and
+// the FIN would only put the server's end in TIME_WAIT.
+static uint8_t PFX(conn_peer_closed)(int sockfd)
 {
-    comux_cinfo_t* cinfo;       // the comux chunk it's responsible for
-    uint32_t thread_id;         // id number (index) of the chunk thread
-    uint8_t is_final_chunk;     // '1' if this is the last chunk for the
-                                // connection ctable[cinfo->id], '0' if not
-} chunk_thread_params_t;
+    struct pollfd pfd = {.fd = sockfd, .events = POLLRDHUP};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & (POLLRDHUP | POLLHUP));
+}
 
-// Takes in the necessary fields and returns a heap-allocated chunk thread
-// parameter struct. Invoked when spawning a new chunk thread.
-chunk_thread_params_t* PFX(chunk_thread_params_make)(comux_cinfo_t* cinfo,
-                                                     uint32_t id,
-                                                     uint8_t is_final)
+// Resets every connection in the table that's still alive. Called by the
+// controller at the end of an exec, so nothing outlives it.
+// Returns the number of connections that were reset.
+static uint32_t PFX(ctable_teardown)()
 {
-    // allocate memory, assign fields, and return
-    chunk_thread_params_t* result = alloc_check(sizeof(chunk_thread_params_t));
-    result->cinfo = cinfo;
-    result->thread_id = id;
-    result->is_final_chunk = is_final;
-    return result;
+    uint32_t count = 0;
+    pthread_mutex_lock(&ctable_lock);
+    for (uint32_t i = 0; i < ctable_len; i++)
+    {
+        if (ctable[i].status != CONN_STATUS_ALIVE)
+        { continue; }
+        PFX(conn_close)(ctable[i].fd);
+        ctable[i].status = CONN_STATUS_DEAD;
+        count++;
+    }
+    pthread_mutex_unlock(&ctable_lock);
+    return count;
 }
 
-// Helper function for logging with chunk threads
-#define chunk_log(log, format, ...) do                          \
-    {                                                           \
-        log_write((log_t*) log,                                 \
-                  "%s" CHPFX "%s" format,                       \
-                  LOG_NOT_USING_FILE(log) ? C_CHPFX : "",       \
-                  chunk_thread_id,                              \
-                  LOG_NOT_USING_FILE(log) ? C_NONE : ""         \
-                  __VA_OPT__(,) __VA_ARGS__);                   \
-    }                                                           \
-    while (0)
 
-// Does one of the following
-//  1. Creates a new connection with the global accepting socket (if one isn't
-//     present in the connection table for the given connection ID) and adds
-//     it to the connection table.
-//  2. Retrieves the existing connection socket FD from the connection table
-//     (if one is already established)
-// The file descriptor of the connection is returned regardless. -1 is returned
-// on error.
-static int PFX(chunk_get_connection)(uint32_t cid)
+// =========================== Response Drainer ============================ //
+// Responses are only read for chunks with the AWAIT_RESPONSE flag. On every
+// other connection, a large enough response fills up the socket buffers, and
+// the server blocks in send() until AFL's timeout runs out. With
+// GURTHANG_LIB_DRAIN set, the controller runs a drainer thread that reads (and
+// throws away) whatever the server sends on any live connection.
+//
+// A chunk thread waiting on a response "claims" its connection before sending
+// the chunk, and the drainer leaves claimed connections alone, so the chunk
+// thread still gets every byte of its response. Chunk threads also claim a
+// connection before closing it, so the drainer never reads from a file
+// descriptor that's been closed (and possibly reused).
+#define DRAIN_MAX_EVENTS 64     // epoll events handled per wakeup
+#define DRAIN_WAIT_MS 10        // how often the drainer checks if it's done
+#define DRAIN_MAX_READS 64      // recv() calls per connection per wakeup
+
+// Who currently owns a connection's receiving end.
+typedef enum drain_owner
 {
-    pthread_mutex_lock(&ctable_lock);
+    DRAIN_OWNER_NONE = 0,       // nobody: the drainer may take it
+    DRAIN_OWNER_DRAINER = 1,    // the drainer is reading from it
+    DRAIN_OWNER_CHUNK = 2       // a chunk thread has claimed it
+} drain_owner_t;
 
-    // take a look at the connection table and see if we can use an existing fd
-    ctable_entry_t* entry = &ctable[cid];
-    switch (entry->status)
-    {
-        // CASE 1: connection was created previously and is still alive
-        case CONN_STATUS_ALIVE:
-            // log a message, unlock, and return the valid file descriptor
-            chunk_log(&log, "found existing socket FD for connection %u: %d",
-                    cid, entry->fd);
-            pthread_mutex_unlock(&ctable_lock);
-            return entry->fd;
-        // CASE 2: connection was previously closed by the server
-        case CONN_STATUS_CLOSED_REMOTE:
-            chunk_log(&log, "%sSKIP:%s existing socket FD for connection %u "
-                      "(%d) was previously closed by the target server.",
-                      LOG_NOT_USING_FILE(&log) ? C_WARN : "",
-                      LOG_NOT_USING_FILE(&log) ? C_NONE : "",
-                      cid, entry->fd);
+static int drain_epfd = -1; // the drainer's epoll instance
+static atomic_int drain_running = 0;
+static atomic_ulong drain_bytes = 0; // bytes drained during this exec
+static __thread uint8_t chunk_thread_claimed = 0; // has this thread claimed?
 
-            // attempt to exit the thread - since the server closed this
-            // connection, the data this chunk thread wants to send no longer
-            // has a place to go. So we're done with this thread.
-            pthread_mutex_unlock(&ctable_lock);
-            pthread_exit(NULL);
-            break;
-        // DEFAULT CASE: proceed to the code below to make a new socket
-        default:
-            break;
-    }
+// Starts watching a newly-connected connection. Called with the connection
+// table locked.
+static void PFX(drain_add)(uint32_t cid, int sockfd)
+{
+    if (!drain_enabled)
+    { return; }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                             .data.u32 = cid};
+    if (real_epoll_ctl(drain_epfd, EPOLL_CTL_ADD, sockfd, &ev))
+    { fatality_errno(errno, "failed to add connection %u to the drainer", cid); }
+}
 
-    // otherwise we'll need to establish a new connection. First, we'll invoke
-    // 'getsockname' to get the correct server address/port to connect to
-    struct sockaddr_storage server_addr;
-    socklen_t server_addr_len = sizeof(struct sockaddr_storage);
-    if (getsockname(accept_sock, (struct sockaddr*) &server_addr, &server_addr_len) == -1)
-    { fatality_errno(errno, "failed to getsockname()"); }
+// Claims a connection for the calling chunk thread, waiting for the drainer
+// to finish with it if needed. Does nothing if the drainer is off.
+static void PFX(drain_claim)(uint32_t cid)
+{
+    if (!drain_enabled || chunk_thread_claimed)
+    { return; }
+    int expected = DRAIN_OWNER_NONE;
+    while (!atomic_compare_exchange_weak(&ctable[cid].drain_owner, &expected,
+                                         DRAIN_OWNER_CHUNK))
+    {
+        expected = DRAIN_OWNER_NONE;
+        sched_yield();
+    }
+    chunk_thread_claimed = 1;
+}
 
-    // create a new socket with the server's address family
-    int sockfd = -1;
-    if ((sockfd = socket(server_addr.ss_family, SOCK_STREAM, 0)) == -1)
-    { fatality_errno(errno, "failed to create a socket"); }
+// Hands a claimed connection back to the drainer. If the connection is still
+// alive, it's re-armed in the drainer's epoll instance, so anything that
+// arrived while it was claimed gets drained.
+static void PFX(drain_release)(uint32_t cid)
+{
+    if (!drain_enabled || !chunk_thread_claimed)
+    { return; }
+    chunk_thread_claimed = 0;
 
-    // attempt to connect
-    if (connect(sockfd, (const struct sockaddr*) &server_addr, server_addr_len) == -1)
-    { fatality_errno(errno, "failed to connect to target server"); }
+    pthread_mutex_lock(&ctable_lock);
+    atomic_store(&ctable[cid].drain_owner, DRAIN_OWNER_NONE);
+    if (ctable[cid].status == CONN_STATUS_ALIVE)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                                 .data.u32 = cid};
+        real_epoll_ctl(drain_epfd, EPOLL_CTL_MOD, ctable[cid].fd, &ev);
+    }
+    pthread_mutex_unlock(&ctable_lock);
+}
 
-    // finally, add this new socket FD to the connection table
-    ctable[cid].fd = sockfd;
-    ctable[cid].status = CONN_STATUS_ALIVE;
-    chunk_log(&log, "created new socket FD for connection %u: %d", cid, sockfd);
+// Reads everything that's waiting on a single connection, if nobody else owns
+// it. Edge-triggered epoll only tells us about new bytes, so we read until
+// there are none left. To keep a chunk thread from waiting on us for too
+// long, we stop after a while and re-arm the connection instead.
+static void PFX(drain_conn)(uint32_t cid, char* buff, size_t buff_len)
+{
+    int expected = DRAIN_OWNER_NONE;
+    if (!atomic_compare_exchange_strong(&ctable[cid].drain_owner, &expected,
+                                        DRAIN_OWNER_DRAINER))
+    { return; }
 
+    pthread_mutex_lock(&ctable_lock);
+    int fd = ctable[cid].status == CONN_STATUS_ALIVE ? ctable[cid].fd : -1;
     pthread_mutex_unlock(&ctable_lock);
-    return sockfd;
+
+    ssize_t rcount = 0;
+    uint32_t reads = 0;
+    while (fd != -1 && reads++ < DRAIN_MAX_READS &&
+           (rcount = recv(fd, buff, buff_len, MSG_DONTWAIT)) > 0)
+    { atomic_fetch_add(&drain_bytes, rcount); }
+    if (rcount > 0)
+    {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                                 .data.u32 = cid};
+        real_epoll_ctl(drain_epfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    atomic_store(&ctable[cid].drain_owner, DRAIN_OWNER_NONE);
 }
 
-// Function responsible for seeking to the correct spot in stdin and reading
-// the comux chunk's data segment into memory.
-// Returns the number of bytes read (return value of 'comux_cinfo_data_read')
-static size_t PFX(chunk_load_data)(comux_cinfo_t* cinfo)
+// The main function for the drainer thread.
+static void* PFX(drain_main)(void* input)
 {
-    // attempt to seek back to the correct offset within stdin
-    if (lseek(STDIN_FILENO, comux_cinfo_data_offset(cinfo), SEEK_SET) == -1)
+    size_t buff_len = chunk_thread_read_buffsize;
+    char* buff = alloc_check(buff_len);
+    struct epoll_event events[DRAIN_MAX_EVENTS];
+    while (atomic_load(&drain_running))
     {
-        fatality_errno(errno, "failed to seek to offset %d of chunk data segment",
-                       cinfo->offset);
+        int count = real_epoll_wait(drain_epfd, events, DRAIN_MAX_EVENTS,
+                                    DRAIN_WAIT_MS);
+        for (int i = 0; i < count; i++)
+        { PFX(drain_conn)(events[i].data.u32, buff, buff_len); }
     }
+    free(buff);
+    return NULL;
+}
 
-    // attempt to read bytes, then log a message
-    size_t rcount = comux_cinfo_data_read(cinfo, STDIN_FILENO);
-    chunk_log(&log, "read %lu bytes for the chunk data segment:\n%s%s%s\n",
-              rcount,
-              LOG_NOT_USING_FILE(&log) ? C_DATA : "",
-              buffer_dptr(&cinfo->data),
-              LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-    return rcount;
+// Starts the drainer. Called by the controller before any chunks are sent.
+static void PFX(drain_start)(pthread_t* tid)
+{
+    drain_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (drain_epfd == -1)
+    { fatality_errno(errno, "failed to create the drainer's epoll instance"); }
+    atomic_store(&drain_bytes, 0);
+    atomic_store(&drain_running, 1);
+    int err = pthread_create(tid, NULL, PFX(drain_main), NULL);
+    if (err)
+    { fatality_errno(err, "failed to spawn the drainer thread"); }
 }
 
-// Helper routine that sends the comux chunk's data across the socket
-// connection to the target server.
-// Returns the number of bytes sent to the server.
-static size_t PFX(chunk_send_data)(comux_cinfo_t* cinfo, int sockfd)
+// Stops the drainer. Called by the controller once every chunk thread has
+// been joined. Returns the number of bytes drained.
+static uint64_t PFX(drain_stop)(pthread_t tid)
 {
-    // get a pointer to the chunk's data and setup looping variables
-    char* dptr = buffer_dptr(&cinfo->data);
-    size_t interval_size = cinfo->len > chunk_thread_write_buffsize ?
-                           chunk_thread_write_buffsize : cinfo->len;
-    ssize_t wcount = 0;
-    size_t total_wcount = 0;
+    atomic_store(&drain_running, 0);
+    pthread_join(tid, NULL);
+    close(drain_epfd);
+    drain_epfd = -1;
+    return atomic_load(&drain_bytes);
+}
 
-    // repeatedly invoke send() until all bytes from the chunk's data segment
-    // have been sent to the target server.
-    // We use MSG_NOSIGNAL as a flag to prevent it from generating the SIGPIPE
-    // signal if the server closes the connection. This allows us to
-    while ((wcount = send(sockfd, dptr + wcount,
-                          MIN(cinfo->len - total_wcount, interval_size),
-                          MSG_NOSIGNAL)) > 0)
-    { total_wcount += wcount; }
 
-    // check for the target server closing the connection
-    if (wcount == -1)
+// ========================= Performance Feedback ========================== //
+// With GURTHANG_LIB_PERF_FEEDBACK set, chunk threads time how long the server
+// takes to start responding to each chunk with the AWAIT_RESPONSE flag. At the
+// end of the exec, the controller writes the slowest of these into AFL's map
+// (see PFX(afl_map_feedback)), so inputs that slow the server down look like
+// new coverage and are kept.
+
+// Returns the current time on the monotonic clock, in microseconds.
+static uint64_t PFX(monotonic_us)()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Records one time-to-response measurement, keeping the largest.
+static void PFX(perf_record_latency)(uint64_t latency)
+{
+    uint64_t current = atomic_load(&perf_max_latency);
+    while (latency > current &&
+           !atomic_compare_exchange_weak(&perf_max_latency, &current, latency))
+    { }
+}
+
+// Returns the CPU time (user and system) the whole process has used so far,
+// in microseconds.
+static uint64_t PFX(perf_cpu_us)()
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+    { fatality_errno(errno, "failed to get the process's resource usage"); }
+    return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+// =========================== Memory Feedback ============================= //
+// With GURTHANG_LIB_MEM_FEEDBACK set, the controller measures how far the
+// process's peak resident memory (VmHWM) grew while the chunks were being sent,
+// and writes it into AFL's map the same way as the performance feedback. With
+// GURTHANG_LIB_MEM_CAP_MB set, a monitor thread watches resident memory while
+// the chunks are sent, and kills the process with SIGUSR1 if it goes over the
+// cap. AFL records that as a crash, long before the kernel's OOM killer would
+// have stepped in (and stalled the whole machine doing so).
+
+// Helper function that reads a small /proc file into the given buffer (as a
+// null-terminated string). Returns the number of bytes read, or -1.
+static ssize_t PFX(mem_read_proc)(const char* path, char* buff, size_t buff_len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    { return -1; }
+    ssize_t total = 0;
+    ssize_t rcount = 0;
+    while (total < (ssize_t) buff_len - 1 &&
+           (rcount = read(fd, buff + total, buff_len - 1 - total)) > 0)
+    { total += rcount; }
+    close(fd);
+    buff[total] = '\0';
+    return rcount == -1 ? -1 : total;
+}
+
+// Returns the process's current resident memory, in bytes.
+static uint64_t PFX(mem_rss)()
+{
+    char buff[128];
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    if (PFX(mem_read_proc)("/proc/self/statm", buff, sizeof(buff)) == -1 ||
+        sscanf(buff, "%lu %lu", &size, &resident) != 2)
+    { fatality("failed to read resident memory from /proc/self/statm"); }
+    return (uint64_t) resident * sysconf(_SC_PAGESIZE);
+}
+
+// Returns the process's peak resident memory (VmHWM), in bytes.
+static uint64_t PFX(mem_peak)()
+{
+    char buff[4096];
+    if (PFX(mem_read_proc)("/proc/self/status", buff, sizeof(buff)) == -1)
+    { fatality("failed to read /proc/self/status"); }
+    char* hwm = strstr(buff, "VmHWM:");
+    unsigned long kb = 0;
+    if (!hwm || sscanf(hwm + 6, "%lu", &kb) != 1)
+    { fatality("failed to read peak resident memory from /proc/self/status"); }
+    return (uint64_t) kb * 1024;
+}
+
+// Resets the process's peak resident memory to its current resident memory,
+// by writing "5" to /proc/self/clear_refs. Returns 0 on success. (Older
+// kernels don't support this, in which case the peak may include memory used
+// before the exec began.)
+static int PFX(mem_peak_reset)()
+{
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd == -1)
+    { return -1; }
+    ssize_t wcount = write(fd, "5", 1);
+    close(fd);
+    return wcount == 1 ? 0 : -1;
+}
+
+// The main function for the memory monitor thread. Checks resident memory
+// every MEM_MONITOR_INTERVAL_US microseconds, until told to stop.
+static void* PFX(mem_monitor_main)(void* input)
+{
+    uint64_t cap = (uint64_t) mem_cap_mb << 20;
+    while (atomic_load(&mem_monitor_running))
     {
-        if (errno == EPIPE || errno == ECONNRESET)
+        uint64_t rss = PFX(mem_rss)();
+        if (rss > cap)
         {
-            chunk_log(&log, "target server closed the connection (%s).",
-                      strerror(errno));
+            log_write(&log, "%sMEMORY CAP:%s resident memory (%lu KB) went over "
+                      "the cap (%lu MB). Killing the process with SIGUSR1.",
+                      LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                      LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                      rss >> 10, mem_cap_mb);
 
-            // update the connection's status in our table, for future threads
-            // (and close the file descriptor)
-            pthread_mutex_lock(&ctable_lock);
-            ctable[cinfo->id].status = CONN_STATUS_CLOSED_REMOTE;
-            pthread_mutex_unlock(&ctable_lock);
-            close(sockfd);
-            return 0;
+            // the server may have its own plans for SIGUSR1 (Apache uses it
+            // for graceful restarts), so we make sure it does the default
+            // thing - killing the process - before raising it
+            sigset_t set;
+            sigemptyset(&set);
+            sigaddset(&set, SIGUSR1);
+            pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+            signal(SIGUSR1, SIG_DFL);
+            raise(SIGUSR1);
         }
-        else
-        { fatality_errno(errno, "failed to send bytes to target server"); }
+        usleep(MEM_MONITOR_INTERVAL_US);
     }
-    
-    // report the number of bytes sent, and handle the case where this chunk is
-    // the final one for the current connection
-    chunk_log(&log, "sent %lu bytes through connection %u", total_wcount, cinfo->id);
-    if (chunk_thread_is_final && !(cinfo->flags & COMUX_CHUNK_FLAGS_NO_SHUTDOWN))
+    return NULL;
+}
+
+
+// ============================ Leak Sentinel ============================== //
+// With GURTHANG_LIB_LEAK_THRESHOLD set, the controller counts the process's
+// open file descriptors and threads right before the first chunk is sent, and
+// again once every chunk has been handled (and the library has closed its
+// connections and joined its threads). If either count grew by at least the
+// threshold, the server leaked them while handling the input, and the process
+// is killed with SIGUSR2 so AFL records the input as a crash. In persistent or
+// deferred setups, these leaks would otherwise slowly drag the campaign down.
+
+// Returns the number of entries in the given /proc directory, or -1 on error.
+// When counting /proc/self/fd, the directory's own file descriptor isn't
+// counted.
+static int64_t PFX(leak_count)(const char* path)
+{
+    DIR* dir = opendir(path);
+    if (!dir)
+    { return -1; }
+    int self = dirfd(dir);
+
+    int64_t count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
     {
-        // if this chunk thread is sending the final data for this particular
-        // connection, then we're done with the write-end of this socket. (So,
-        // we'll shut it down)
-        if (shutdown(sockfd, SHUT_WR) == -1)
-        { fatality_errno(errno, "failed to shutdown socket's write-end"); }
+        if (entry->d_name[0] == '.')
+        { continue; }
+        long fd = 0;
+        if (!str_to_int(entry->d_name, &fd) && fd == self &&
+            !strcmp(path, "/proc/self/fd"))
+        { continue; }
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
 
-        // notify the user
-        chunk_log(&log, "%sFINAL:%s closed socket's write-end",
-                  LOG_NOT_USING_FILE(&log) ? C_NOTE : "",
-                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+// Takes in the file descriptor and thread counts from the start of the exec
+// and checks for leaks. The server may still be closing connections and
+// winding threads down from the last chunk, so counts over the threshold are
+// re-checked a few times before we call it a leak.
+static void PFX(leak_check)(int64_t fds_start, int64_t threads_start)
+{
+    int64_t fds = 0;
+    int64_t threads = 0;
+    for (int i = 0; i < LEAK_SETTLE_TRIES; i++)
+    {
+        fds = PFX(leak_count)("/proc/self/fd") - fds_start;
+        threads = PFX(leak_count)("/proc/self/task") - threads_start;
+        if (fds < (int64_t) leak_threshold && threads < (int64_t) leak_threshold)
+        { return; }
+        usleep(LEAK_SETTLE_US);
     }
 
-    return total_wcount;
+    log_write(&log, "%sLEAK:%s the server leaked %ld file descriptor(s) and "
+              "%ld thread(s) (the threshold is %lu). Killing the process with "
+              "SIGUSR2.",
+              LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+              LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+              fds, threads, leak_threshold);
+
+    // make sure SIGUSR2 kills the process, even if the server handles it
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+    signal(SIGUSR2, SIG_DFL);
+    raise(SIGUSR2);
 }
 
-// Attempts to recv() bytes from the target server on the active connection
-// specified by the given socket file descriptor. The response is printed to
-// STDOUT, and the number of bytes read is returned.
-static size_t PFX(chunk_recv_data)(comux_cinfo_t* cinfo, int sockfd)
+
+// ============================= Trace Output ============================== //
+// With GURTHANG_LIB_TRACE set to a file path, the controller and chunk threads
+// record a span for each step they take: connecting, loading a chunk from
+// stdin, sending it, awaiting the response, and closing the connection. Each
+// span is written to the file (and flushed) as soon as it's recorded, in the
+// JSON array flavor of Chrome's Trace Event format, which chrome://tracing and
+// ui.perfetto.dev can both open. That format doesn't need the closing ']', so
+// if the exec hangs and AFL kills the process, everything up to the hang is
+// still there to look at. Each thread gets its own row, so a connection that
+// stalled shows up as one long bar.
+typedef struct trace_span
 {
-    // first, we'll set up a buffer to hold the server's response
-    size_t buff_len = chunk_thread_read_buffsize;
-    char buff[buff_len];
+    const char* name;           // what was done (or the thread's name)
+    uint8_t is_thread_name;     // '1' if this just names the thread
+    uint32_t tid;               // OS thread ID of the thread that did it
+    int64_t cid;                // connection ID (-1 if there isn't one)
+    int64_t sched;              // the chunk's sched value (-1 if none)
+    uint64_t start;             // when it started (monotonic, us)
+    uint64_t dur;               // how long it took (us)
+} trace_span_t;
 
-    chunk_log(&log, "receiving bytes from connection %u (to stdout)",
-              cinfo->id);
+static FILE* trace_fp = NULL;   // the trace file, while it's open
+static uint64_t trace_start = 0; // when the controller started (us)
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread uint32_t trace_tid = 0; // cached OS thread ID
 
-    // repteatedly receive bytes from the server until some error occurs or
-    // we run out of bytes
-    ssize_t rcount = 0;
-    size_t total_rcount = 0;
-    while ((rcount = recv(sockfd, buff, buff_len, 0)) > 0)
-    {
-        total_rcount += rcount;
+// Returns the current time for the start of a span, or zero if tracing is
+// turned off (so callers can always pass the result to PFX(trace_span)).
+static uint64_t PFX(trace_now)()
+{ return trace_path ? PFX(monotonic_us)() : 0; }
 
-        // dump all the bytes to stdout
-        ssize_t wcount = 0;
-        size_t total_wcount = 0;
-        while ((wcount = write(STDOUT_FILENO, buff + total_wcount,
-                               rcount - total_wcount)) > 0)
-        { total_wcount += wcount; }
+// Opens (and truncates) the trace file, and writes out the start of the
+// array. Called by the controller when it starts, before any spans come in.
+static void PFX(trace_open)()
+{
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE* fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!fp)
+    { fatality_errno(errno, "failed to open %s", trace_path); }
 
-        // check for failure to write to stdout
-        if (wcount == -1)
-        { fatality_errno(errno, "failed to write bytes to stdout"); }
+    pthread_mutex_lock(&trace_lock);
+    trace_fp = fp;
+    fprintf(trace_fp, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"gurthang\"}}", getpid());
+    fflush(trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Writes a span out to the trace file and flushes it. Takes the lock, so any
+// thread may call this. Spans that come in while the file isn't open are
+// dropped.
+static void PFX(trace_push)(trace_span_t* span)
+{
+    if (!trace_tid)
+    { trace_tid = (uint32_t) syscall(SYS_gettid); }
+    span->tid = trace_tid;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_fp)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return;
     }
-    if (total_rcount > 0)
-    { write(STDOUT_FILENO, "\n", 1); }
 
-    // check for error - if we get a specific error(s) (such as ECONNRESET),
-    // we don't need to exit. Just move on and close the socket
-    int8_t do_conn_close = total_rcount == 0;
-    if (rcount == -1)
+    // Chrome wants microsecond timestamps. We make them relative to the
+    // controller's start so they're easy to read
+    pid_t pid = getpid();
+    if (span->is_thread_name)
     {
-        if (errno == ECONNRESET)
-        { do_conn_close = -1; }
-        else
-        { fatality_errno(errno, "failed to read bytes from target server"); }
+        fprintf(trace_fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                "\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                pid, span->tid, span->name);
     }
-    
-    // if it's decided we need to close the connection, do so
-    if (do_conn_close)
+    else
     {
-        // print according to *what* caused the connection to be closed
-        if (do_conn_close == -1)
+        uint64_t ts = span->start > trace_start ? span->start - trace_start : 0;
+        fprintf(trace_fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+                "\"tid\":%u,\"ts\":%lu,\"dur\":%lu,\"args\":{",
+                span->name, pid, span->tid, ts, span->dur);
+        if (span->cid >= 0)
+        { fprintf(trace_fp, "\"cid\":%ld", span->cid); }
+        if (span->sched >= 0)
         {
-            chunk_log(&log, "target server closed the connection. (%s)",
-                      strerror(errno));
+            fprintf(trace_fp, "%s\"sched\":%ld", span->cid >= 0 ? "," : "",
+                    span->sched);
         }
-        else
-        { chunk_log(&log, "target server closed the connection."); }
+        fprintf(trace_fp, "}}");
+    }
+    fflush(trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
 
-        // update the connection's status in our table, so any future threads
-        // working with this socket are aware. Then, close the FD
-        pthread_mutex_lock(&ctable_lock);
-        ctable[cinfo->id].status = CONN_STATUS_CLOSED_REMOTE;
-        pthread_mutex_unlock(&ctable_lock);
-        close(sockfd);
-        return total_rcount;
+// Gives the calling thread a name in the trace.
+static void PFX(trace_thread)(const char* name)
+{
+    if (!trace_path)
+    { return; }
+    trace_span_t span = {.name = name, .is_thread_name = 1};
+    PFX(trace_push)(&span);
+}
+
+// Records a span for the calling thread that started at the given time (from
+// PFX(trace_now)) and ends now. Pass -1 for 'cid' or 'sched' to leave them
+// out of the span's arguments.
+static void PFX(trace_span)(const char* name, int64_t cid, int64_t sched,
+                            uint64_t start)
+{
+    if (!trace_path)
+    { return; }
+    uint64_t end = PFX(monotonic_us)();
+    trace_span_t span = {
+        .name = name,
+        .cid = cid,
+        .sched = sched,
+        .start = start,
+        .dur = end - start
+    };
+    PFX(trace_push)(&span);
+}
+
+// Closes off the array and the trace file. Called by the controller once the
+// exec is over and every other thread is done.
+static void PFX(trace_close)()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fp)
+    {
+        fprintf(trace_fp, "\n]\n");
+        fclose(trace_fp);
+        trace_fp = NULL;
     }
+    pthread_mutex_unlock(&trace_lock);
+}
 
-    chunk_log(&log, "received %lu bytes from connection %u",
-              total_rcount, cinfo->id);
-    return total_rcount;
+
+// =========================== Upstream Emulator =========================== //
+// Reverse proxies forward each request they receive to an upstream server.
+// With GURTHANG_LIB_UPSTREAM set to a list of "HOST:PORT" addresses, our
+// connect() sends the proxy's connections to those addresses to a listener
+// inside this library instead. Each upstream connection reads one request and
+// answers it with:
+//  1. The next chunk with the UPSTREAM flag, in scheduling order. These chunks
+//     are never sent to the server; they're the upstream's half of the comux
+//     file, and get mutated along with everything else. If the chunk has the
+//     NO_SHUTDOWN flag, the connection stays open for another request. If it
+//     has the RESET flag, it's reset after the reset offset.
+//  2. Once those run out, the contents of GURTHANG_LIB_UPSTREAM_RESPONSE.
+//  3. If there's nothing left to answer with, the connection is closed.
+#define UPSTREAM_BUFFSIZE 4096 // recv() buffer for upstream requests
+#define UPSTREAM_TEARDOWN_TRIES 200 // times to check on connection threads...
+#define UPSTREAM_TEARDOWN_US 500    // ...and the time to wait between checks
+
+// The upstream response queue: pointers into the controller's chunk array.
+typedef struct upstream_queue
+{
+    comux_cinfo_t** chunks;     // UPSTREAM chunks, in scheduling order
+    uint32_t len;               // number of chunks in the queue
+    uint32_t next;              // index of the next chunk to answer with
+    pthread_mutex_t lock;       // protects all of the above
+} upstream_queue_t;
+static upstream_queue_t upstream_queue = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static int upstream_sock = -1; // the emulator's listener socket
+static struct sockaddr_in upstream_sock_addr; // ...and its address
+static pthread_once_t upstream_start_once = PTHREAD_ONCE_INIT;
+static atomic_uint upstream_conns = 0; // number of connections emulated
+static fdset_t upstream_fds; // our ends of the upstream connections still open
+static pthread_mutex_t upstream_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_uint upstream_live = 0; // connection threads still running
+
+// Comparison function used to sort the upstream chunks. Works the same way as
+// PFX(chunk_plan_cmp): by scheduling value, then by position in the file.
+static int PFX(upstream_cmp)(const void* a, const void* b)
+{
+    const comux_cinfo_t* c1 = *(comux_cinfo_t* const*) a;
+    const comux_cinfo_t* c2 = *(comux_cinfo_t* const*) b;
+    if (c1->sched != c2->sched)
+    { return c1->sched < c2->sched ? -1 : 1; }
+    return c1 < c2 ? -1 : c1 > c2;
 }
 
-// The main function for each chunk thread. Chunk threads take in a pointer to
-// a heap-allocated comux_cinfo_t struct, and use it to 
-static void* PFX(chunk_main)(void* input)
+// Invoked by the controller once it's parsed the chunk headers. Queues up the
+// UPSTREAM chunks as responses.
+static void PFX(upstream_load)(comux_cinfo_t* chunks, uint32_t num_chunks)
 {
-    // retrieve needed fields from the parameter struct, then free it
-    chunk_thread_params_t* params = (chunk_thread_params_t*) input;
-    comux_cinfo_t* cinfo = params->cinfo;
-    chunk_thread_is_final = params->is_final_chunk;
-    chunk_thread_id = params->thread_id;
-    free(params);
+    pthread_mutex_lock(&upstream_queue.lock);
+    upstream_queue.chunks = alloc_check(sizeof(comux_cinfo_t*) * (num_chunks + 1));
+    upstream_queue.len = 0;
+    upstream_queue.next = 0;
+    for (uint32_t i = 0; i < num_chunks; i++)
+    {
+        if (chunks[i].flags & COMUX_CHUNK_FLAGS_UPSTREAM)
+        { upstream_queue.chunks[upstream_queue.len++] = &chunks[i]; }
+    }
+    qsort(upstream_queue.chunks, upstream_queue.len, sizeof(comux_cinfo_t*),
+          PFX(upstream_cmp));
+    pthread_mutex_unlock(&upstream_queue.lock);
+}
 
-    chunk_log(&log, "spawned to handle chunk with fields: "
-              "conn_id=%u, datalen=%lu, sched=%u, flags=0x%x.",
-              cinfo->id, cinfo->len, cinfo->sched, cinfo->flags);
+// Invoked by the controller before it frees the chunks. Any upstream
+// connections still open from here on answer from the response file (or not
+// at all).
+static void PFX(upstream_unload)()
+{
+    pthread_mutex_lock(&upstream_queue.lock);
+    free(upstream_queue.chunks);
+    upstream_queue.chunks = NULL;
+    upstream_queue.len = 0;
+    upstream_queue.next = 0;
+    pthread_mutex_unlock(&upstream_queue.lock);
+}
 
-    // first, try to get an active connection with the server, based on the
-    // chunk's connection ID
-    int fd = PFX(chunk_get_connection)(cinfo->id);
-    if (fd == -1)
+// Invoked by the controller at the end of an exec. Shuts down every upstream
+// connection that's still open (including the ones a proxy keeps alive in its
+// pool), then waits a little while for their threads to close them and exit,
+// so the leak sentinel doesn't count them against the server. Returns the
+// number of connections that were shut down.
+static uint32_t PFX(upstream_teardown)()
+{
+    uint32_t count = 0;
+    pthread_mutex_lock(&upstream_fds_lock);
+    for (uint32_t fd = 0; fd < upstream_fds.len; fd++)
     {
-        fatality("failed to get an active connection for connection %u",
-                 cinfo->id);
+        // skip over whole words of the set that are empty
+        if (fd % 64 == 0 && !atomic_load(&upstream_fds.bits[fd / 64]))
+        {
+            fd += 63;
+            continue;
+        }
+        if (PFX(fdset_has)(&upstream_fds, fd))
+        {
+            shutdown(fd, SHUT_RDWR);
+            count++;
+        }
     }
+    pthread_mutex_unlock(&upstream_fds_lock);
 
-    // next, read the chunk's data bytes from stdin
-    size_t data_length = PFX(chunk_load_data)(cinfo);
-    if (data_length == 0)
+    for (int i = 0; i < UPSTREAM_TEARDOWN_TRIES && atomic_load(&upstream_live); i++)
+    { usleep(UPSTREAM_TEARDOWN_US); }
+    return count;
+}
+
+// Returns non-zero if the given address is one of the upstreams we emulate.
+static uint8_t PFX(upstream_match)(const struct sockaddr* addr, socklen_t len)
+{
+    if (!addr || len < sizeof(struct sockaddr_in) || addr->sa_family != AF_INET)
+    { return 0; }
+    const struct sockaddr_in* in = (const struct sockaddr_in*) addr;
+    for (uint32_t i = 0; i < upstream_addrs_len; i++)
     {
-        fatality("read zero bytes from a chunk data segment."
-                 "Please check your input file.");
+        if (upstream_addrs[i].sin_port == in->sin_port &&
+            (upstream_addrs[i].sin_addr.s_addr == htonl(INADDR_ANY) ||
+             upstream_addrs[i].sin_addr.s_addr == in->sin_addr.s_addr))
+        { return 1; }
     }
+    return 0;
+}
 
-    // send the data bytes over to the target server. If the connection was
-    // closed, go no further
-    if (PFX(chunk_send_data)(cinfo, fd) == 0)
+// Takes the next response off the queue and writes a copy of its data into
+// 'out'. Returns the response's flags, or sets 'out' to NULL if the queue is
+// empty. The copy is ours to free, so the controller can free its chunks
+// whenever it likes.
+static uint32_t PFX(upstream_next)(char** out, size_t* out_len)
+{
+    uint32_t flags = 0;
+    *out = NULL;
+    pthread_mutex_lock(&upstream_queue.lock);
+    if (upstream_queue.next < upstream_queue.len)
     {
+        comux_cinfo_t* cinfo = upstream_queue.chunks[upstream_queue.next++];
+        comux_cinfo_data_pread(cinfo, STDIN_FILENO);
+        *out_len = cinfo->flags & COMUX_CHUNK_FLAGS_RESET ?
+                   comux_cinfo_reset_offset(cinfo) : cinfo->len;
+        *out = alloc_check(*out_len + 1);
+        memcpy(*out, buffer_dptr(&cinfo->data), *out_len);
+        flags = cinfo->flags;
         comux_cinfo_free(cinfo);
-        return NULL;
     }
+    pthread_mutex_unlock(&upstream_queue.lock);
+    return flags;
+}
 
-    // if specified by the chunk's header data, wait for the server's response
-    if (cinfo->flags & COMUX_CHUNK_FLAGS_AWAIT_RESPONSE)
-    { PFX(chunk_recv_data)(cinfo, fd); }
+// Sends all the given bytes on an upstream connection. Returns non-zero if the
+// proxy went away partway through.
+static int PFX(upstream_send)(int fd, const char* data, size_t len)
+{
+    size_t total = 0;
+    while (total < len)
+    {
+        ssize_t wcount = send(fd, data + total, len - total, MSG_NOSIGNAL);
+        if (wcount == -1 && errno == EINTR)
+        { continue; }
+        if (wcount <= 0)
+        { return -1; }
+        total += wcount;
+    }
+    return 0;
+}
 
-    comux_cinfo_free(cinfo);
+// The main function for a single emulated upstream connection.
+static void* PFX(upstream_conn_main)(void* input)
+{
+    int fd = (int) (intptr_t) input;
+    uint32_t id = atomic_fetch_add(&upstream_conns, 1);
+    char buff[UPSTREAM_BUFFSIZE];
+    uint8_t reset = 0;
+    while (1)
+    {
+        // wait for the proxy's request, then soak up whatever else of it has
+        // already arrived. We don't parse requests, so this assumes the proxy
+        // writes each one out in one go (which they do)
+        ssize_t rcount = recv(fd, buff, sizeof(buff), 0);
+        if (rcount <= 0)
+        { break; }
+        size_t total = rcount;
+        while ((rcount = recv(fd, buff, sizeof(buff), MSG_DONTWAIT)) > 0)
+        { total += rcount; }
+
+        // answer with the next UPSTREAM chunk, or the response file
+        char* data = NULL;
+        size_t data_len = 0;
+        uint32_t flags = PFX(upstream_next)(&data, &data_len);
+        if (!data && !upstream_response)
+        {
+            log_write(&log, "upstream connection %u: received %lu bytes, with "
+                      "nothing to respond with.", id, total);
+            break;
+        }
+        int err = data ? PFX(upstream_send)(fd, data, data_len) :
+                  PFX(upstream_send)(fd, upstream_response, upstream_response_len);
+        log_write(&log, "upstream connection %u: received %lu bytes, sent "
+                  "%lu bytes%s.", id, total,
+                  data ? data_len : upstream_response_len,
+                  data ? "" : " from the response file");
+        free(data);
+        if (err)
+        { break; }
+
+        // only a chunk can keep the connection open (or reset it)
+        reset = (flags & COMUX_CHUNK_FLAGS_RESET) != 0;
+        if (!data || reset || !(flags & COMUX_CHUNK_FLAGS_NO_SHUTDOWN))
+        { break; }
+    }
+
+    // let the proxy close its end first, so TIME_WAIT ends up on its side
+    // rather than piling up in here
+    if (reset)
+    {
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    else
+    {
+        shutdown(fd, SHUT_WR);
+        while (recv(fd, buff, sizeof(buff), 0) > 0)
+        { /* drain */ }
+    }
+
+    // take the connection out of the open set before closing it, so the
+    // teardown never shuts down a file descriptor that's been reused
+    pthread_mutex_lock(&upstream_fds_lock);
+    PFX(fdset_remove)(&upstream_fds, fd);
+    pthread_mutex_unlock(&upstream_fds_lock);
+    close(fd);
+    atomic_fetch_sub(&upstream_live, 1);
     return NULL;
 }
 
+// The main function for the emulator's accepting thread.
+static void* PFX(upstream_main)(void* input)
+{
+    while (1)
+    {
+        int fd = real_accept4(upstream_sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            { continue; }
+            fatality_errno(errno, "upstream emulator failed to accept()");
+        }
+        pthread_mutex_lock(&upstream_fds_lock);
+        PFX(fdset_add)(&upstream_fds, fd);
+        pthread_mutex_unlock(&upstream_fds_lock);
+        atomic_fetch_add(&upstream_live, 1);
+
+        pthread_t tid;
+        int err = pthread_create(&tid, NULL, PFX(upstream_conn_main),
+                                 (void*) (intptr_t) fd);
+        if (err)
+        { fatality_errno(err, "failed to spawn an upstream connection thread"); }
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+// Sets up the emulator's listener on an ephemeral loopback port and spawns
+// the thread that accepts on it. Invoked once, by the controller before the
+// leak sentinel takes its counts (or by the first connect() to an upstream
+// address, if that comes first). We go around our own listen() and accept(),
+// since this socket has nothing to do with the server's.
+static void PFX(upstream_start)()
+{
+    PFX(fdset_init)(&upstream_fds);
+    upstream_sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (upstream_sock == -1)
+    { fatality_errno(errno, "failed to create the upstream emulator socket"); }
+
+    socklen_t addr_len = sizeof(upstream_sock_addr);
+    memset(&upstream_sock_addr, 0, sizeof(upstream_sock_addr));
+    upstream_sock_addr.sin_family = AF_INET;
+    upstream_sock_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (real_bind(upstream_sock, (struct sockaddr*) &upstream_sock_addr,
+                  addr_len) ||
+        real_listen(upstream_sock, SOMAXCONN) ||
+        getsockname(upstream_sock, (struct sockaddr*) &upstream_sock_addr,
+                    &addr_len))
+    { fatality_errno(errno, "failed to set up the upstream emulator socket"); }
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, PFX(upstream_main), NULL);
+    if (err)
+    { fatality_errno(err, "failed to spawn the upstream emulator thread"); }
+    pthread_detach(tid);
+    log_write(&log, "upstream emulator listening on port %u.",
+              ntohs(upstream_sock_addr.sin_port));
+}
+
+
+// ============================== Chunk Thead ============================== //
+// Used to pass in all the necessary data for a single chunk thread. The
+// controller builds an array of these (the "dispatch plan") up front, sorted
+// in the order the chunks are to be sent.
+typedef struct chunk_thread_parameters
+{
+    comux_cinfo_t* cinfo;       // the comux chunk it's responsible for
+    uint32_t thread_id;         // id number (index) of the chunk thread
+    uint32_t file_index;        // index of the chunk within the comux file
+    uint8_t is_final_chunk;     // '1' if this is the last chunk for the
+                                // connection ctable[cinfo->id], '0' if not
+} chunk_thread_params_t;
 
-// =========================== Controller Thead ============================ //
 // Helper function for logging with chunk threads
-#define ctl_log(log, format, ...) do                            \
+#if GURTHANG_LIB_LOG_ENABLED
+#define chunk_log(log, format, ...) do                          \
     {                                                           \
         log_write((log_t*) log,                                 \
-                  "%s" COPFX "%s" format,                       \
-                  LOG_NOT_USING_FILE(log) ? C_COPFX : "",       \
+                  "%s" CHPFX "%s" format,                       \
+                  LOG_NOT_USING_FILE(log) ? C_CHPFX : "",       \
+                  chunk_thread_id,                              \
                   LOG_NOT_USING_FILE(log) ? C_NONE : ""         \
                   __VA_OPT__(,) __VA_ARGS__);                   \
     }                                                           \
     while (0)
+#else
+#define chunk_log(log, format, ...) do                          \
+    {                                                           \
+        if (0)                                                  \
+        {                                                       \
+            log_write((log_t*) log, format                      \
+                      __VA_OPT__(,) __VA_ARGS__);               \
+        }                                                       \
+    }                                                           \
+    while (0)
+#endif
 
-// Helper function used to have the controller thread exit/kill the entire
-// process.
-static void PFX(controller_exit)()
+// Binds the given socket to the next port in GURTHANG_LIB_PORT_RANGE, using
+// the same address the server is listening on. Ports that are taken are
+// skipped. If every port in the range is taken, the program exits.
+static void PFX(chunk_bind_port)(int sockfd, struct sockaddr_storage* server_addr,
+                                 socklen_t server_addr_len)
 {
-    if (exit_immediate)
-    { _exit(EXIT_SUCCESS); }
-    else
-    { exit(EXIT_SUCCESS); }
+    struct sockaddr_storage addr;
+    memcpy(&addr, server_addr, server_addr_len);
+    int one = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    uint32_t range_len = port_range_hi - port_range_lo + 1;
+    for (uint32_t i = 0; i < range_len; i++)
+    {
+        uint16_t port = port_range_lo + (atomic_fetch_add(&port_range_next, 1) %
+                                         range_len);
+        if (addr.ss_family == AF_INET)
+        { ((struct sockaddr_in*) &addr)->sin_port = htons(port); }
+        else
+        { ((struct sockaddr_in6*) &addr)->sin6_port = htons(port); }
+
+        if (real_bind(sockfd, (struct sockaddr*) &addr, server_addr_len) == 0)
+        {
+            chunk_log(&log, "bound to source port %u.", port);
+            return;
+        }
+        if (errno != EADDRINUSE)
+        { fatality_errno(errno, "failed to bind to source port %u", port); }
+    }
+    fatality("every source port in %s (%u-%u) is in use.",
+             GURTHANG_ENV_LIB_PORT_RANGE, port_range_lo, port_range_hi);
 }
 
-// The main function for the main library thread.
-static void* PFX(controller_main)(void* input)
+// Creates a new socket and connects it to the server's listener address. If
+// connect() fails for a reason that's likely to be temporary (such as running
+// out of ephemeral ports), we back off and try again with a fresh socket.
+// Returns the connected socket. If every attempt fails, the program exits.
+static int PFX(chunk_connect)(struct sockaddr_storage* server_addr,
+                              socklen_t server_addr_len)
 {
-    ctl_log(&log, "controller thread spawned. Reading from stdin...");
+    uint8_t is_inet = server_addr->ss_family == AF_INET ||
+                      server_addr->ss_family == AF_INET6;
+    for (int attempt = 0; attempt < CONNECT_RETRY_MAX; attempt++)
+    {
+        // create a new socket with the server's address family. Any close()
+        // of it, on any path, is a reset (see PFX(conn_close))
+        int sockfd = -1;
+        if ((sockfd = socket(server_addr->ss_family, SOCK_STREAM, 0)) == -1)
+        { fatality_errno(errno, "failed to create a socket"); }
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+
+        // for TCP, send each piece of data as soon as we have it, and pick a
+        // source port ourselves, if we were asked to
+        if (is_inet)
+        {
+            int one = 1;
+            setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (port_range_lo)
+            { PFX(chunk_bind_port)(sockfd, server_addr, server_addr_len); }
+        }
+
+        // attempt to connect (going around our own connect(), which is only
+        // interested in the server's outbound connections)
+        if (real_connect(sockfd, (const struct sockaddr*) server_addr,
+                         server_addr_len) == 0)
+        { return sockfd; }
+
+        // count the failure, and decide if it's worth trying again
+        int err = errno;
+        atomic_fetch_add(&connect_failures, 1);
+        close(sockfd);
+        if (err != EADDRNOTAVAIL && err != EADDRINUSE && err != EAGAIN &&
+            err != EINTR && err != ETIMEDOUT)
+        { fatality_errno(err, "failed to connect to target server"); }
+
+        chunk_log(&log, "%sWARNING:%s failed to connect to target server "
+                  "(%s). Retrying...",
+                  LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                  strerror(err));
+        usleep(CONNECT_RETRY_DELAY_US << attempt);
+    }
+
+    fatality("failed to connect to target server after %d attempts.",
+             CONNECT_RETRY_MAX);
+    return -1;
+}
+
+// Does one of the following
+//  1. Creates a new connection with the global accepting socket (if one isn't
+//     present in the connection table for the given connection ID) and adds
+//     it to the connection table.
+//  2. Retrieves the existing connection socket FD from the connection table
+//     (if one is already established)
+// The file descriptor of the connection is returned regardless. -1 is returned
+// if the connection was already closed by the target server.
+static int PFX(chunk_get_connection)(uint32_t cid)
+{
+    pthread_mutex_lock(&ctable_lock);
+
+    // take a look at the connection table and see if we can use an existing fd
+    ctable_entry_t* entry = &ctable[cid];
+    switch (entry->status)
+    {
+        // CASE 1: connection was created previously and is still alive
+        case CONN_STATUS_ALIVE:
+            // log a message, unlock, and return the valid file descriptor
+            chunk_log(&log, "found existing socket FD for connection %u: %d",
+                    cid, entry->fd);
+            pthread_mutex_unlock(&ctable_lock);
+            return entry->fd;
+        // CASE 2: connection was previously closed by the server
+        case CONN_STATUS_CLOSED_REMOTE:
+            chunk_log(&log, "%sSKIP:%s existing socket FD for connection %u "
+                      "(%d) was previously closed by the target server.",
+                      LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                      LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                      cid, entry->fd);
+
+            // since the server closed this connection, the data this chunk
+            // wants to send no longer has a place to go. So we're done
+            pthread_mutex_unlock(&ctable_lock);
+            return -1;
+        // CASE 3: connection was reset by an earlier chunk
+        case CONN_STATUS_CLOSED_LOCAL:
+            chunk_log(&log, "%sSKIP:%s existing socket FD for connection %u "
+                      "(%d) was reset by an earlier chunk.",
+                      LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                      LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                      cid, entry->fd);
+            pthread_mutex_unlock(&ctable_lock);
+            return -1;
+        // DEFAULT CASE: proceed to the code below to make a new socket
+        default:
+            break;
+    }
+
+    // otherwise we'll need to establish a new connection. First, we'll invoke
+    // 'getsockname' to get the correct server address/port to connect to
+    struct sockaddr_storage server_addr;
+    socklen_t server_addr_len = sizeof(struct sockaddr_storage);
+    if (getsockname(accept_sock, (struct sockaddr*) &server_addr, &server_addr_len) == -1)
+    { fatality_errno(errno, "failed to getsockname()"); }
+
+    // create a new socket and connect it to the server
+    int sockfd = PFX(chunk_connect)(&server_addr, server_addr_len);
+
+    // finally, add this new socket FD to the connection table
+    ctable[cid].fd = sockfd;
+    ctable[cid].status = CONN_STATUS_ALIVE;
+    PFX(drain_add)(cid, sockfd);
+    GURTHANG_PROBE2(connect, cid, sockfd);
+    chunk_log(&log, "created new socket FD for connection %u: %d", cid, sockfd);
+
+    pthread_mutex_unlock(&ctable_lock);
+    return sockfd;
+}
+
+// Marks the given connection as closed by the target server in the connection
+// table, then closes our end of it.
+static void PFX(chunk_conn_closed)(uint32_t cid, int sockfd)
+{
+    uint64_t trace_t = PFX(trace_now)();
+    PFX(drain_claim)(cid);
+    pthread_mutex_lock(&ctable_lock);
+    ctable[cid].status = CONN_STATUS_CLOSED_REMOTE;
+    pthread_mutex_unlock(&ctable_lock);
+    PFX(conn_close)(sockfd);
+    PFX(trace_span)("close", cid, chunk_thread_sched, trace_t);
+}
+
+// Resets the given connection (for a chunk with the RESET flag) and marks it
+// as such in the connection table, so any later chunks for it are skipped.
+static void PFX(chunk_conn_reset)(uint32_t cid, int sockfd)
+{
+    uint64_t trace_t = PFX(trace_now)();
+    PFX(drain_claim)(cid);
+    pthread_mutex_lock(&ctable_lock);
+    ctable[cid].status = CONN_STATUS_CLOSED_LOCAL;
+    pthread_mutex_unlock(&ctable_lock);
+    PFX(conn_close)(sockfd);
+    PFX(trace_span)("close", cid, chunk_thread_sched, trace_t);
+    chunk_log(&log, "%sRESET:%s reset connection %u.",
+              LOG_NOT_USING_FILE(&log) ? C_NOTE : "",
+              LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+              cid);
+}
+
+// Function responsible for reading the comux chunk's data segment from its
+// spot in stdin into memory. We use pread() here, since several chunk threads
+// may be reading from stdin at once.
+// Returns the number of bytes read (return value of 'comux_cinfo_data_pread')
+static size_t PFX(chunk_load_data)(comux_cinfo_t* cinfo)
+{
+    // attempt to read bytes, then log a message
+    size_t rcount = comux_cinfo_data_pread(cinfo, STDIN_FILENO);
+    chunk_log(&log, "read %lu bytes for the chunk data segment:\n%s%s%s\n",
+              rcount,
+              LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+              buffer_dptr(&cinfo->data),
+              LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+    return rcount;
+}
+
+// Helper routine that sends the comux chunk's data across the socket
+// connection to the target server.
+// Returns the number of bytes sent to the server.
+static size_t PFX(chunk_send_data)(comux_cinfo_t* cinfo, int sockfd)
+{
+    // get a pointer to the chunk's data and setup looping variables. If the
+    // chunk asks to be segmented, each segment gets its own send() calls. If
+    // the connection is to be reset partway through the chunk, we stop there
+    char* dptr = buffer_dptr(&cinfo->data);
+    size_t send_len = cinfo->flags & COMUX_CHUNK_FLAGS_RESET ?
+                      comux_cinfo_reset_offset(cinfo) : cinfo->len;
+    size_t segment_size = comux_cinfo_segment_size(cinfo);
+    uint32_t segment_gap = comux_cinfo_segment_gap(cinfo);
+    size_t interval_size = segment_size ? segment_size :
+                           chunk_thread_write_buffsize;
+    ssize_t wcount = 0;
+    size_t total_wcount = 0;
+    if (segment_size)
+    {
+        chunk_log(&log, "sending in segments of %lu byte(s), %u us apart.",
+                  segment_size, segment_gap);
+    }
+    GURTHANG_PROBE2(send_begin, cinfo->id, send_len);
+
+    // repeatedly invoke send() until all bytes from the chunk's data segment
+    // have been sent to the target server.
+    // We use MSG_NOSIGNAL as a flag to prevent it from generating the SIGPIPE
+    // signal if the server closes the connection. This allows us to handle it
+    // below. An unsegmented chunk is sent with MSG_MORE on every piece but the
+    // last, so the kernel packs it into as few TCP segments as it can. With
+    // segmentation, TCP_NODELAY pushes each segment out on its own
+    while (total_wcount < send_len)
+    {
+        size_t piece_end = MIN(send_len, total_wcount + interval_size);
+        int flags = MSG_NOSIGNAL;
+        if (!segment_size && piece_end < send_len)
+        { flags |= MSG_MORE; }
+
+        while (total_wcount < piece_end &&
+               (wcount = send(sockfd, dptr + total_wcount,
+                              piece_end - total_wcount, flags)) > 0)
+        { total_wcount += wcount; }
+        if (wcount == -1)
+        { break; }
+
+        // wait between segments, if the chunk asks for it
+        if (segment_gap && total_wcount < send_len)
+        { usleep(segment_gap); }
+    }
+
+    // check for the target server closing the connection
+    GURTHANG_PROBE2(send_end, cinfo->id, total_wcount);
+    if (wcount == -1)
+    {
+        if (errno == EPIPE || errno == ECONNRESET)
+        {
+            chunk_log(&log, "target server closed the connection (%s).",
+                      strerror(errno));
+
+            // update the connection's status in our table, for future threads
+            // (and close the file descriptor)
+            PFX(chunk_conn_closed)(cinfo->id, sockfd);
+            return 0;
+        }
+        else
+        { fatality_errno(errno, "failed to send bytes to target server"); }
+    }
+    
+    // if we're measuring performance, the clock starts now
+    if (perf_feedback)
+    { chunk_thread_sent_at = PFX(monotonic_us)(); }
+
+    // report the number of bytes sent, and handle the case where this chunk is
+    // the final one for the current connection
+    chunk_log(&log, "sent %lu bytes through connection %u", total_wcount, cinfo->id);
+    if (chunk_thread_is_final &&
+        !(cinfo->flags & (COMUX_CHUNK_FLAGS_NO_SHUTDOWN | COMUX_CHUNK_FLAGS_RESET)) &&
+        !PFX(conn_peer_closed)(sockfd))
+    {
+        // if this chunk thread is sending the final data for this particular
+        // connection, then we're done with the write-end of this socket. (So,
+        // we'll shut it down)
+        // (the server may have reset the connection after our last send()
+        // went through, which is no different from the send() failing)
+        if (shutdown(sockfd, SHUT_WR) == -1)
+        {
+            if (errno != ENOTCONN && errno != ECONNRESET)
+            { fatality_errno(errno, "failed to shutdown socket's write-end"); }
+
+            chunk_log(&log, "target server closed the connection (%s).",
+                      strerror(errno));
+            PFX(chunk_conn_closed)(cinfo->id, sockfd);
+            return 0;
+        }
+
+        // notify the user
+        chunk_log(&log, "%sFINAL:%s closed socket's write-end",
+                  LOG_NOT_USING_FILE(&log) ? C_NOTE : "",
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+    }
+
+    return total_wcount;
+}
+
+// Attempts to recv() bytes from the target server on the active connection
+// specified by the given socket file descriptor. The response is printed to
+// STDOUT, and the number of bytes read is returned.
+static size_t PFX(chunk_recv_data)(comux_cinfo_t* cinfo, int sockfd)
+{
+    // first, we'll set up a buffer to hold the server's response
+    size_t buff_len = chunk_thread_read_buffsize;
+    char buff[buff_len];
+
+    chunk_log(&log, "receiving bytes from connection %u (to stdout)",
+              cinfo->id);
+
+    // repteatedly receive bytes from the server until some error occurs or
+    // we run out of bytes. If we're measuring performance, the time from when
+    // the chunk was sent until the first bytes show up is the server's
+    // time-to-response
+    ssize_t rcount = 0;
+    size_t total_rcount = 0;
+    GURTHANG_PROBE1(recv_begin, cinfo->id);
+    while ((rcount = recv(sockfd, buff, buff_len, 0)) > 0)
+    {
+        if (perf_feedback && total_rcount == 0)
+        {
+            uint64_t latency = PFX(monotonic_us)() - chunk_thread_sent_at;
+            chunk_log(&log, "time-to-response: %lu us.", latency);
+            PFX(perf_record_latency)(latency);
+        }
+        total_rcount += rcount;
+
+        // dump all the bytes to stdout
+        ssize_t wcount = 0;
+        size_t total_wcount = 0;
+        while ((wcount = write(STDOUT_FILENO, buff + total_wcount,
+                               rcount - total_wcount)) > 0)
+        { total_wcount += wcount; }
+
+        // check for failure to write to stdout
+        if (wcount == -1)
+        { fatality_errno(errno, "failed to write bytes to stdout"); }
+    }
+    if (total_rcount > 0)
+    { write(STDOUT_FILENO, "\n", 1); }
+    GURTHANG_PROBE2(recv_end, cinfo->id, total_rcount);
+
+    // check for error - if we get a specific error(s) (such as ECONNRESET),
+    // we don't need to exit. Just move on and close the socket
+    int8_t do_conn_close = total_rcount == 0;
+    if (rcount == -1)
+    {
+        if (errno == ECONNRESET)
+        { do_conn_close = -1; }
+        else
+        { fatality_errno(errno, "failed to read bytes from target server"); }
+    }
+    
+    // if it's decided we need to close the connection, do so
+    if (do_conn_close)
+    {
+        // print according to *what* caused the connection to be closed
+        if (do_conn_close == -1)
+        {
+            chunk_log(&log, "target server closed the connection. (%s)",
+                      strerror(errno));
+        }
+        else
+        { chunk_log(&log, "target server closed the connection."); }
+
+        // update the connection's status in our table, so any future threads
+        // working with this socket are aware. Then, close the FD
+        PFX(chunk_conn_closed)(cinfo->id, sockfd);
+        return total_rcount;
+    }
+
+    chunk_log(&log, "received %lu bytes from connection %u",
+              total_rcount, cinfo->id);
+    return total_rcount;
+}
+
+// Handles a single chunk from the controller's dispatch plan. Chunk threads
+// take in a pointer to their entry in the plan, and use it to load, send, and
+// (optionally) await a response for the chunk.
+static void PFX(chunk_handle)(chunk_thread_params_t* params)
+{
+    // retrieve needed fields from the parameter struct
+    comux_cinfo_t* cinfo = params->cinfo;
+    chunk_thread_is_final = params->is_final_chunk;
+    chunk_thread_id = params->thread_id;
+    chunk_thread_sched = cinfo->sched;
+
+    chunk_log(&log, "handling chunk with fields: "
+              "conn_id=%u, datalen=%lu, sched=%u, flags=0x%x.",
+              cinfo->id, cinfo->len, cinfo->sched, cinfo->flags);
+    GURTHANG_PROBE3(chunk_dispatch, chunk_thread_id, cinfo->id, cinfo->sched);
+
+    // first, try to get an active connection with the server, based on the
+    // chunk's connection ID. If the server already closed it, there's nothing
+    // left for us to do
+    uint64_t trace_t = PFX(trace_now)();
+    int fd = PFX(chunk_get_connection)(cinfo->id);
+    PFX(trace_span)("connect", cinfo->id, cinfo->sched, trace_t);
+    if (fd == -1)
+    { return; }
+
+    // next, read the chunk's data bytes from stdin
+    trace_t = PFX(trace_now)();
+    size_t data_length = PFX(chunk_load_data)(cinfo);
+    PFX(trace_span)("load", cinfo->id, cinfo->sched, trace_t);
+    if (data_length == 0)
+    {
+        fatality("read zero bytes from a chunk data segment."
+                 "Please check your input file.");
+    }
+
+    // if we'll be waiting for the server's response, keep the drainer away
+    // from it (it gets the connection back when we're done)
+    if (cinfo->flags & COMUX_CHUNK_FLAGS_AWAIT_RESPONSE)
+    { PFX(drain_claim)(cinfo->id); }
+
+    // send the data bytes over to the target server. If the connection was
+    // closed, go no further
+    trace_t = PFX(trace_now)();
+    size_t sent = PFX(chunk_send_data)(cinfo, fd);
+    PFX(trace_span)("send", cinfo->id, cinfo->sched, trace_t);
+    if (sent == 0)
+    { goto done; }
+
+    // if the chunk asks for it, reset the connection. There's no response to
+    // wait for after that
+    if (cinfo->flags & COMUX_CHUNK_FLAGS_RESET)
+    {
+        PFX(chunk_conn_reset)(cinfo->id, fd);
+        goto done;
+    }
+
+    // if specified by the chunk's header data, wait for the server's response
+    if (cinfo->flags & COMUX_CHUNK_FLAGS_AWAIT_RESPONSE)
+    {
+        trace_t = PFX(trace_now)();
+        PFX(chunk_recv_data)(cinfo, fd);
+        PFX(trace_span)("await", cinfo->id, cinfo->sched, trace_t);
+    }
+
+done:
+    PFX(drain_release)(cinfo->id);
+    comux_cinfo_free(cinfo);
+}
+
+
+// ============================ Chunk Thread Pool ============================ //
+// Rather than spawning one thread per chunk, the controller hands the dispatch
+// plan to a bounded pool of chunk threads. The controller "releases" chunks to
+// the pool: one at a time by default (waiting for each to finish before
+// releasing the next), or all at once in NO_WAIT mode. Workers take released
+// chunks strictly in plan order.
+typedef struct chunk_pool
+{
+    chunk_thread_params_t* plan;    // the dispatch plan
+    uint32_t plan_len;              // number of entries in the plan
+    uint32_t released;              // number of entries workers may take
+    uint32_t next;                  // index of the next entry to take
+    uint32_t finished;              // number of entries fully handled
+    pthread_mutex_t lock;           // protects all of the above
+    pthread_cond_t cond_released;   // signaled when entries are released
+    pthread_cond_t cond_finished;   // signaled when an entry is finished
+} chunk_pool_t;
+static chunk_pool_t pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond_released = PTHREAD_COND_INITIALIZER,
+    .cond_finished = PTHREAD_COND_INITIALIZER
+};
+
+// The main function for each chunk thread in the pool. Takes released plan
+// entries one at a time until every entry in the plan has been taken.
+static void* PFX(chunk_main)(void* input)
+{
+    PFX(trace_thread)("chunk thread");
+    while (1)
+    {
+        // wait for an entry to be released (or for the plan to run out)
+        pthread_mutex_lock(&pool.lock);
+        while (pool.next >= pool.released && pool.next < pool.plan_len)
+        { pthread_cond_wait(&pool.cond_released, &pool.lock); }
+        if (pool.next >= pool.plan_len)
+        {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        uint32_t idx = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+
+        // handle the chunk, then report back
+        PFX(chunk_handle)(&pool.plan[idx]);
+        pthread_mutex_lock(&pool.lock);
+        pool.finished++;
+        pthread_cond_broadcast(&pool.cond_finished);
+        pthread_mutex_unlock(&pool.lock);
+    }
+    return NULL;
+}
+
+// Releases plan entries to the chunk thread pool, up to (but not including)
+// the given index.
+static void PFX(chunk_pool_release)(uint32_t count)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.released = count;
+    pthread_cond_broadcast(&pool.cond_released);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// Blocks until the given number of plan entries have been fully handled.
+static void PFX(chunk_pool_await)(uint32_t count)
+{
+    pthread_mutex_lock(&pool.lock);
+    while (pool.finished < count)
+    { pthread_cond_wait(&pool.cond_finished, &pool.lock); }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+// ========================== AFL++ Coverage Map =========================== //
+// When the target is instrumented by AFL++, its coverage map lives in shared
+// memory, and the instrumentation exports a pointer to it (and its size). We
+// look these up at runtime, so the library still works with targets that
+// aren't instrumented (there's simply no map to touch).
+#define AFL_MAP_SIZE_DEFAULT (1 << 16) // AFL's default MAP_SIZE
+
+// Looks up the target's AFL++ coverage map. Returns a pointer to it (and
+// writes its length into 'len'), or NULL if the target isn't instrumented.
+static uint8_t* PFX(afl_map)(size_t* len)
+{
+    uint8_t** area_ptr = dlsym(RTLD_DEFAULT, "__afl_area_ptr");
+    if (!area_ptr || !*area_ptr)
+    { return NULL; }
+
+    uint32_t* map_size = dlsym(RTLD_DEFAULT, "__afl_map_size");
+    *len = map_size && *map_size ? *map_size : AFL_MAP_SIZE_DEFAULT;
+    return *area_ptr;
+}
+
+// Returns the number of bytes at the start of the map that the target's
+// instrumentation hands out to edges, or 0 if we can't tell. AFL++'s PCGUARD
+// and LTO modes number edges one after another and export the count. Other
+// modes scatter edges over the whole map, and don't.
+static uint32_t PFX(afl_map_edges)()
+{
+    uint32_t* final_loc = dlsym(RTLD_DEFAULT, "__afl_final_loc");
+    return final_loc ? *final_loc : 0;
+}
+
+// The last few bytes of the map are used for feedback that isn't code
+// coverage, such as how long the server took to respond. Each kind of feedback
+// gets its own region of AFL_FEEDBACK_SLOTS bytes, counting back from the end
+// of the map (region 0 is the very last one). Nothing reserves these bytes: the
+// map has to be bigger than the target's edges need, which the controller
+// checks for before it sends anything (see PFX(controller_feedback_check)).
+#define AFL_FEEDBACK_SLOTS 32
+typedef enum afl_feedback_region
+{
+    AFL_FEEDBACK_LATENCY = 0,   // slowest time-to-response (us)
+    AFL_FEEDBACK_CPU = 1,       // CPU time used during the exec (us)
+    AFL_FEEDBACK_MEMORY = 2,    // growth in peak resident memory (KB)
+} afl_feedback_region_t;
+
+// Writes a value into the given feedback region of the map. Values are
+// bucketed by their base-2 logarithm, and written "thermometer-style": every
+// slot up to and including the value's bucket is set. So, an input that
+// reaches a higher bucket than any input before it lights up a slot AFL has
+// never seen set, which AFL treats as new coverage, and keeps the input.
+// Returns the bucket (the number of slots that were set).
+static uint32_t PFX(afl_map_feedback)(uint8_t* map, size_t len,
+                                      afl_feedback_region_t region,
+                                      uint64_t value)
+{
+    uint32_t bucket = 0;
+    while (value && bucket < AFL_FEEDBACK_SLOTS)
+    {
+        value >>= 1;
+        bucket++;
+    }
+
+    size_t end = len - (region * AFL_FEEDBACK_SLOTS);
+    if (end < AFL_FEEDBACK_SLOTS + 1)
+    { return 0; }
+    uint8_t* slots = map + end - AFL_FEEDBACK_SLOTS;
+    for (uint32_t i = 0; i < bucket; i++)
+    { slots[i] = 1; }
+    return bucket;
+}
+
+
+// =========================== Controller Thead ============================ //
+// Helper function for logging with the controller thread
+#if GURTHANG_LIB_LOG_ENABLED
+#define ctl_log(log, format, ...) do                            \
+    {                                                           \
+        log_write((log_t*) log,                                 \
+                  "%s" COPFX "%s" format,                       \
+                  LOG_NOT_USING_FILE(log) ? C_COPFX : "",       \
+                  LOG_NOT_USING_FILE(log) ? C_NONE : ""         \
+                  __VA_OPT__(,) __VA_ARGS__);                   \
+    }                                                           \
+    while (0)
+#else
+#define ctl_log(log, format, ...) do                            \
+    {                                                           \
+        if (0)                                                  \
+        {                                                       \
+            log_write((log_t*) log, format                      \
+                      __VA_OPT__(,) __VA_ARGS__);               \
+        }                                                       \
+    }                                                           \
+    while (0)
+#endif
+
+// Wipes the coverage map, so AFL++ only sees the code paths the server took
+// while handling our connections, and not its startup (config parsing, module
+// loading, and so on). Byte 0 is left alone, since AFL's runtime sets it to let
+// the fuzzer know the target actually ran.
+static void PFX(controller_coverage_reset)()
+{
+    size_t len = 0;
+    uint8_t* map = PFX(afl_map)(&len);
+    if (!map)
+    {
+        ctl_log(&log, "%sWARNING:%s no AFL++ coverage map found. Not resetting.",
+                LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        return;
+    }
+    memset(map + 1, 0, len - 1);
+    ctl_log(&log, "reset %lu bytes of AFL++ coverage.", len);
+}
+
+// Writes a feedback value into one of the feedback regions at the end of the
+// coverage map, and returns the bucket it fell into (see PFX(afl_map_feedback)).
+static uint32_t PFX(controller_feedback)(afl_feedback_region_t region,
+                                         uint64_t value)
+{
+    size_t len = 0;
+    uint8_t* map = PFX(afl_map)(&len);
+    if (!map)
+    {
+        ctl_log(&log, "%sWARNING:%s no AFL++ coverage map found. Not writing "
+                "feedback.",
+                LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        return 0;
+    }
+    return PFX(afl_map_feedback)(map, len, region, value);
+}
+
+// Makes sure the feedback regions we're about to write don't land on the
+// target's own edges. If the map is too small to hold both, every feedback
+// write would corrupt real coverage, so we refuse to go any further.
+static void PFX(controller_feedback_check)()
+{
+    size_t len = 0;
+    uint8_t* map = PFX(afl_map)(&len);
+    if (!map)
+    { return; }
+
+    // the regions count back from the end of the map, so the lowest one in
+    // use decides how much room we need
+    uint32_t regions = mem_feedback ? AFL_FEEDBACK_MEMORY + 1 :
+                       perf_feedback_cpu ? AFL_FEEDBACK_CPU + 1 :
+                       AFL_FEEDBACK_LATENCY + 1;
+    size_t needed = (size_t) PFX(afl_map_edges)() + regions * AFL_FEEDBACK_SLOTS;
+    if (needed > len)
+    {
+        fatality("the AFL++ coverage map holds %lu bytes, but the target's "
+                 "edges and the feedback regions need %lu. Set AFL_MAP_SIZE "
+                 "to at least %lu, or turn the feedback off.",
+                 len, needed, needed);
+    }
+    ctl_log(&log, "the feedback regions fit after the target's %u edge(s).",
+            PFX(afl_map_edges)());
+}
+
+// Helper function used to have the controller thread exit/kill the entire
+// process.
+static void PFX(controller_exit)()
+{
+    GURTHANG_PROBE0(exit);
+
+    // if we're not in the process that called listen(), it needs to know
+    // the exec is over. It'll exit, and the rest of the processes will be
+    // taken down with it
+    if (mp_region && !mp_is_root)
+    {
+        ctl_log(&log, "notifying the listener process.");
+        sem_post(&mp_region->exec_done);
+    }
+
+    if (exit_immediate)
+    { _exit(EXIT_SUCCESS); }
+    else
+    { exit(EXIT_SUCCESS); }
+}
+
+// Makes sure the process is allowed to hold enough file descriptors for the
+// given number of comux connections. Each connection takes up two of them (our
+// end and the server's end), plus some headroom for whatever else the server
+// has open.
+static void PFX(fd_limit_raise)(uint32_t num_conns)
+{
+    rlim_t needed = ((rlim_t) num_conns * 2) + FD_LIMIT_HEADROOM;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    { fatality_errno(errno, "failed to get the file descriptor limit"); }
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= needed)
+    { return; }
+
+    // try to raise the soft limit (and the hard limit, if we must - this only
+    // works if we're privileged)
+    rlim_t old = rl.rlim_cur;
+    rl.rlim_cur = needed;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < needed)
+    { rl.rlim_max = needed; }
+    if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        ctl_log(&log, "raised file descriptor limit from %lu to %lu.",
+                (unsigned long) old, (unsigned long) needed);
+        return;
+    }
+
+    // otherwise, settle for the hard limit
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+    { fatality_errno(errno, "failed to get the file descriptor limit"); }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+    { fatality_errno(errno, "failed to raise the file descriptor limit"); }
+    ctl_log(&log, "%sWARNING:%s raised file descriptor limit from %lu to %lu, "
+            "but %lu may be needed for %u connection(s).",
+            LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+            LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+            (unsigned long) old, (unsigned long) rl.rlim_cur,
+            (unsigned long) needed, num_conns);
+}
+
+// Comparison function used to sort the dispatch plan. Chunks with lower
+// scheduling values go first; ties are broken by the chunk's position in the
+// comux file, which keeps the sort stable.
+static int PFX(chunk_plan_cmp)(const void* a, const void* b)
+{
+    const chunk_thread_params_t* p1 = a;
+    const chunk_thread_params_t* p2 = b;
+    if (p1->cinfo->sched != p2->cinfo->sched)
+    { return p1->cinfo->sched < p2->cinfo->sched ? -1 : 1; }
+    return p1->file_index < p2->file_index ? -1 :
+           p1->file_index > p2->file_index;
+}
+
+// Takes in the parsed chunks and builds the dispatch plan: an array of chunk
+// thread parameters, sorted in the order the chunks should be sent. Each
+// connection's final chunk is marked along the way. UPSTREAM chunks are left
+// out, since they're never sent to the server. Returns the plan (and its
+// length, through 'plan_len'), which must be freed by the caller.
+static chunk_thread_params_t* PFX(chunk_plan_make)(comux_cinfo_t* chunks,
+                                                   uint32_t num_chunks,
+                                                   uint32_t num_conns,
+                                                   uint32_t* plan_len)
+{
+    chunk_thread_params_t* plan = alloc_check(sizeof(chunk_thread_params_t) *
+                                              (num_chunks + 1));
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < num_chunks; i++)
+    {
+        if (chunks[i].flags & COMUX_CHUNK_FLAGS_UPSTREAM)
+        { continue; }
+        plan[len].cinfo = &chunks[i];
+        plan[len].file_index = i;
+        plan[len].is_final_chunk = 0;
+        len++;
+    }
+
+    // sort the plan by scheduling value
+    qsort(plan, len, sizeof(chunk_thread_params_t), PFX(chunk_plan_cmp));
+
+    // walk the sorted plan once to find each connection's last chunk. If any
+    // connection doesn't have one, it was assigned zero chunks (which is only
+    // alright if it was holding UPSTREAM chunks)
+    uint32_t* last_chunk = alloc_check(sizeof(uint32_t) * (num_conns + 1));
+    memset(last_chunk, 0xff, sizeof(uint32_t) * num_conns);
+    for (uint32_t i = 0; i < len; i++)
+    {
+        plan[i].thread_id = i;
+        last_chunk[plan[i].cinfo->id] = i;
+    }
+    for (uint32_t i = 0; i < num_chunks; i++)
+    {
+        if (last_chunk[chunks[i].id] == UINT32_MAX)
+        { last_chunk[chunks[i].id] = UINT32_MAX - 1; }
+    }
+    for (uint32_t i = 0; i < num_conns; i++)
+    {
+        if (last_chunk[i] == UINT32_MAX)
+        { fatality("connection ID %u is assigned zero chunks in this file.", i); }
+        if (last_chunk[i] < len)
+        { plan[last_chunk[i]].is_final_chunk = 1; }
+    }
+    *plan_len = len;
+
+    free(last_chunk);
+    return plan;
+}
+
+// The main function for the main library thread.
+static void* PFX(controller_main)(void* input)
+{
+    ctl_log(&log, "controller thread spawned. Reading from stdin...");
+    trace_start = PFX(trace_now)();
+    if (trace_path)
+    { PFX(trace_open)(); }
+    PFX(trace_thread)("controller");
+
+    // the first thing we'll do is read the comux header from stdin
+    comux_header_t header;
+    comux_header_init(&header);
+    comux_parse_result_t res = comux_header_read(&header, STDIN_FILENO);
+    if (res)
+    {
+        fatality("failed to parse comux header: %s",
+                 comux_parse_result_string(res));
+    }
+    ctl_log(&log, STAB_TREE2 "found comux formatting with "
+            "%u connection(s) and %u chunk(s).",
+            header.num_conns, header.num_chunks);
+    GURTHANG_PROBE2(controller_start, header.num_conns, header.num_chunks);
+    
+    // the header is untrusted, and we size everything below from it. So,
+    // make sure stdin is actually big enough to hold the number of chunks it
+    // claims to have (each one needs at least a chunk header), and that every
+    // connection could possibly have a chunk. If stdin isn't a regular file,
+    // we can't know its size, so we fall back to a fixed cap
+    uint32_t num_chunks = header.num_chunks;
+    uint64_t max_chunks = STDIN_MAX_CHUNKS;
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        max_chunks = st.st_size > COMUX_HEADER_LEN ?
+            (st.st_size - COMUX_HEADER_LEN) / COMUX_CINFO_HEADER_LEN : 0;
+    }
+    if (num_chunks > max_chunks)
+    {
+        fatality("the given comux file claims %u chunk(s), but only has "
+                 "room for %lu", num_chunks, max_chunks);
+    }
+    if (header.num_conns > num_chunks)
+    {
+        fatality("the given comux file has more connections (%u) than chunks (%u)",
+                 header.num_conns, num_chunks);
+    }
+
+    // set up the connection table and make sure we can open enough sockets
+    ctable = alloc_check(sizeof(ctable_entry_t) * (header.num_conns + 1));
+    memset(ctable, 0, sizeof(ctable_entry_t) * (header.num_conns + 1));
+    ctable_len = header.num_conns;
+    PFX(fd_limit_raise)(header.num_conns);
+
+    // next, we'll read each chunk header into a single contiguous array.
+    // Because these chunk structs will be passed to other threads, we need
+    // them to be placed on the heap
+    comux_cinfo_t* chunks = alloc_check(sizeof(comux_cinfo_t) * (num_chunks + 1));
+    for (uint32_t i = 0; i < num_chunks; i++)
+    {
+        comux_cinfo_t* current = &chunks[i];
+        comux_cinfo_init(current);
+        
+        // read the cinfo's header information
+        if ((res = comux_cinfo_read(current, STDIN_FILENO)))
+        {
+            fatality("failed to parse comux chunk %u: %s",
+                     i + 1, comux_parse_result_string(res));
+        }
+
+        // write a message out to the log describing what we found
+        ctl_log(&log, "%sfound chunk %u with fields: "
+                "conn_id=%u, datalen=%lu, sched=%u, flags=0x%x.",
+                i < num_chunks - 1 ? STAB_TREE2 : STAB_TREE1, i,
+                current->id, current->len, current->sched, current->flags);
+        
+        // make sure the connection ID is within the range specified by the
+        // header's 'num_conns'
+        if (current->id >= header.num_conns)
+        {
+            fatality("Chunk %u has a connection ID (%u) outside the range of "
+                     "specified connections: [0, %u]",
+                     i, current->id, header.num_conns);
+        }
+        
+        // for now, we won't read the data for each chunk. We'll seek past it
+        // to get to the next connection header
+        if (lseek(STDIN_FILENO, current->len, SEEK_CUR) == -1)
+        { fatality_errno(errno, "failed to seek past chunk %u's data segment", i + 1); }
+    }
+
+    // at this point we've parsed the comux header and all the chunk headers.
+    // Build the dispatch plan: the order in which we'll send the chunks (that
+    // is, comux chunks with LOWER 'sched' fields will go first)
+    uint32_t plan_len = 0;
+    chunk_thread_params_t* plan = PFX(chunk_plan_make)(chunks, num_chunks,
+                                                       header.num_conns,
+                                                       &plan_len);
+    if (upstream_addrs_len)
+    { PFX(upstream_load)(chunks, num_chunks); }
+    PFX(trace_span)("parse", -1, -1, trace_start);
+
+    // we're about to start sending chunks. If requested, throw away all the
+    // coverage the server collected up to this point
+    if (coverage_reset)
+    { PFX(controller_coverage_reset)(); }
+    if (perf_feedback || perf_feedback_cpu || mem_feedback)
+    { PFX(controller_feedback_check)(); }
+    uint64_t cpu_start = perf_feedback_cpu ? PFX(perf_cpu_us)() : 0;
+
+    // if we're measuring memory growth, take note of where we're starting
+    // from, and make that the peak
+    uint64_t mem_start = 0;
+    if (mem_feedback)
+    {
+        mem_start = PFX(mem_rss)();
+        if (PFX(mem_peak_reset)())
+        {
+            ctl_log(&log, "%sWARNING:%s failed to reset peak resident memory. "
+                    "Memory growth may be underestimated.",
+                    LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                    LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        }
+    }
+
+    // the upstream emulator's listener and accepting thread stick around for
+    // the rest of the process, so they're set up before the leak sentinel's
+    // counts are taken, rather than partway through the exec
+    if (upstream_addrs_len)
+    { pthread_once(&upstream_start_once, PFX(upstream_start)); }
+
+    // if we're looking for leaks, count what the server has open before any
+    // of our own threads are spawned
+    int64_t leak_fds_start = 0;
+    int64_t leak_threads_start = 0;
+    if (leak_threshold)
+    {
+        leak_fds_start = PFX(leak_count)("/proc/self/fd");
+        leak_threads_start = PFX(leak_count)("/proc/self/task");
+        if (leak_fds_start == -1 || leak_threads_start == -1)
+        { fatality("failed to count open file descriptors and threads"); }
+        ctl_log(&log, "the server has %ld file descriptor(s) and %ld thread(s) "
+                "open.", leak_fds_start, leak_threads_start);
+    }
+
+    // if there's a memory cap, start up the thread that enforces it
+    pthread_t mem_monitor_tid;
+    if (mem_cap_mb)
+    {
+        atomic_store(&mem_monitor_running, 1);
+        int err = pthread_create(&mem_monitor_tid, NULL, PFX(mem_monitor_main), NULL);
+        if (err)
+        { fatality_errno(err, "failed to spawn the memory monitor thread"); }
+    }
+
+    // if requested, start draining responses nobody is waiting for
+    pthread_t drain_tid;
+    if (drain_enabled)
+    { PFX(drain_start)(&drain_tid); }
+
+    // spin up the chunk thread pool. When we're waiting on each chunk
+    // before sending the next, only one chunk is ever in flight, so a single
+    // thread does the job
+    uint32_t num_threads = wait_for_chunk_threads ? 1 :
+                           MIN(plan_len, chunk_pool_max_threads);
+    pthread_t* chunk_tids = alloc_check(sizeof(pthread_t) * (num_threads + 1));
+    pool.plan = plan;
+    pool.plan_len = plan_len;
+    for (uint32_t i = 0; i < num_threads; i++)
+    {
+        int err = pthread_create(&chunk_tids[i], NULL, PFX(chunk_main), NULL);
+        if (err)
+        { fatality_errno(err, "failed to spawn chunk thread %u", i); }
+    }
+    ctl_log(&log, "spawned %u chunk thread(s).%s%s%s", num_threads,
+            LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+            wait_for_chunk_threads ? "" : " NO_WAIT mode enabled.",
+            LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+
+    if (wait_for_chunk_threads)
+    {
+        // release the chunks one at a time, in plan order, waiting for each
+        // one to finish before moving onto the next
+        for (uint32_t idx = 0; idx < plan_len; idx++)
+        {
+            ctl_log(&log, "dispatching chunk %u.", idx);
+            uint64_t trace_t = PFX(trace_now)();
+            PFX(chunk_pool_release)(idx + 1);
+            PFX(chunk_pool_await)(idx + 1);
+            PFX(trace_span)("dispatch", plan[idx].cinfo->id,
+                            plan[idx].cinfo->sched, trace_t);
+            ctl_log(&log, "chunk %u finished.", idx);
+        }
+    }
+    else
+    {
+        // if NO_WAIT mode is enabled, we'll release every chunk at once and
+        // let the pool work through them
+        ctl_log(&log, "%sNO_WAIT:%s dispatching all chunks. Waiting...",
+                LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        uint64_t trace_t = PFX(trace_now)();
+        PFX(chunk_pool_release)(plan_len);
+        PFX(chunk_pool_await)(plan_len);
+        PFX(trace_span)("dispatch", -1, -1, trace_t);
+    }
+
+    // every chunk has been handled, so the chunk threads will have exited (or
+    // are about to). Join them all
+    for (uint32_t i = 0; i < num_threads; i++)
+    {
+        int join_err = pthread_join(chunk_tids[i], NULL);
+        if (join_err)
+        { fatality_errno(join_err, "failed to join chunk thread %u", i); }
+    }
+    ctl_log(&log, "joined %u chunk thread(s).", num_threads);
+    free(chunk_tids);
+    if (drain_enabled)
+    {
+        uint64_t drained = PFX(drain_stop)(drain_tid);
+        ctl_log(&log, "drained %lu byte(s) of unawaited responses.", drained);
+    }
+
+    // if we're measuring the server's performance, pass the results on to AFL
+    if (perf_feedback)
+    {
+        uint64_t latency = atomic_load(&perf_max_latency);
+        uint32_t bucket = PFX(controller_feedback)(AFL_FEEDBACK_LATENCY, latency);
+        ctl_log(&log, "slowest time-to-response: %lu us (bucket %u).",
+                latency, bucket);
+    }
+    if (perf_feedback_cpu)
+    {
+        uint64_t cpu = PFX(perf_cpu_us)() - cpu_start;
+        uint32_t bucket = PFX(controller_feedback)(AFL_FEEDBACK_CPU, cpu);
+        ctl_log(&log, "CPU time used: %lu us (bucket %u).", cpu, bucket);
+    }
+
+    // stop the memory monitor, and report on memory growth
+    if (mem_cap_mb)
+    {
+        atomic_store(&mem_monitor_running, 0);
+        pthread_join(mem_monitor_tid, NULL);
+    }
+    if (mem_feedback)
+    {
+        uint64_t peak = PFX(mem_peak)();
+        uint64_t growth = peak > mem_start ? (peak - mem_start) >> 10 : 0;
+        uint32_t bucket = PFX(controller_feedback)(AFL_FEEDBACK_MEMORY, growth);
+        ctl_log(&log, "peak resident memory grew by %lu KB (bucket %u).",
+                growth, bucket);
+    }
+
+    // reset any connections that are still open, and report on how many
+    // times we had trouble connecting
+    uint64_t trace_t = PFX(trace_now)();
+    uint32_t reset_count = PFX(ctable_teardown)();
+    PFX(trace_span)("teardown", -1, -1, trace_t);
+    ctl_log(&log, "reset %u open connection(s).", reset_count);
+    if (upstream_addrs_len)
+    {
+        uint32_t upstream_count = PFX(upstream_teardown)();
+        ctl_log(&log, "shut down %u open upstream connection(s).", upstream_count);
+    }
+    uint32_t failures = atomic_load(&connect_failures);
+    if (failures > 0)
+    {
+        log_write(&log, "%sWARNING:%s connect() failed %u time(s) during this "
+                  "exec.",
+                  LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                  failures);
+    }
+
+    // now that every connection is closed and every chunk thread is joined,
+    // look for anything the server left behind
+    if (leak_threshold)
+    { PFX(leak_check)(leak_fds_start, leak_threads_start); }
+
+    // finish off the trace, if we're keeping one
+    if (trace_path)
+    {
+        PFX(trace_close)();
+        ctl_log(&log, "wrote the trace to %s.", trace_path);
+    }
+
+    // free chunk memory (taking it away from the upstream emulator first)
+    if (upstream_addrs_len)
+    { PFX(upstream_unload)(); }
+    for (uint32_t i = 0; i < num_chunks; i++)
+    { comux_cinfo_free(&chunks[i]); }
+    free(plan);
+    free(chunks);
+
+    // print an exit message and return
+    ctl_log(&log, "exiting.");
+    PFX(controller_exit)();
+    return NULL;
+}
+
+// Spawns the main library thread (the "controller" thread). This thread is
+// responsible for reading comux-formatted input from stdin and spawning
+// threads for each chunk specified within the comux file.
+// If spawning the thread fails, the program exits.
+static void PFX(controller_spawn)()
+{
+    // attempt to spawn the thread
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, PFX(controller_main), NULL);
+    if (err)
+    { fatality_errno(err, "failed to spawn main library thread"); }
+
+    // detach the controller thread - nobody will be calling pthread_join() on
+    // it in the future, so we need the OS to clean its resources up itself
+    err = pthread_detach(tid);
+    if (err)
+    {
+        fatality_errno(err, "failed to detacth main library thread: %s",
+                       strerror(err));
+    }
+}
+
+// Spawns the controller thread exactly once. Whichever thread flips the
+// once-flag first does the spawning; everyone else falls straight through.
+// This is kept out of line so the hooks below only pay for a single atomic
+// load once the controller is running.
+static void PFX(controller_spawn_once)(const char* via)
+{
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&controller_initialized, &expected, 1))
+    { return; }
+
+    // in a multi-process server, each process has its own once-flag, so we
+    // also need to win the shared one. Otherwise another process is (or will
+    // be) running the controller
+    expected = 0;
+    if (mp_region &&
+        !atomic_compare_exchange_strong(&mp_region->controller_elected,
+                                        &expected, 1))
+    { return; }
+
+    log_write(&log, "spawning controller thread (via %s).", via);
+    PFX(controller_spawn)();
+}
+
+// Returns non-zero if the controller thread has already been spawned. Used as
+// the fast path in each of our injected system calls.
+#define controller_spawned() \
+    atomic_load_explicit(&controller_initialized, memory_order_acquire)
+
+
+// ========================= Multi-Process Support ========================= //
+// Prefork servers (such as Apache's prefork MPM) call listen() in one process,
+// then fork a handful of children that each call accept(). With
+// GURTHANG_LIB_MULTI_PROCESS set, the controller gets elected into whichever
+// process reaches accept() first, but AFL is waiting on the process it
+// launched. So, the first time that process forks, it spawns a watcher thread
+// that waits for the controller to finish and then exits on its behalf. Every
+// child the listener process forks asks the kernel to kill it when its parent
+// dies, so nothing is left running between execs. This is opt-in, since it
+// changes what fork() does for every server that forks after listen().
+
+// The main function for the watcher thread.
+static void* PFX(mp_watcher_main)(void* input)
+{
+    while (sem_wait(&mp_region->exec_done) == -1)
+    {
+        if (errno != EINTR)
+        { fatality_errno(errno, "failed to wait on the exec semaphore"); }
+    }
+
+    log_write(&log, "the controller finished in another process. Exiting.");
+    PFX(controller_exit)();
+    return NULL;
+}
+
+// Runs in the parent process before each fork(). Saves its PID so the child
+// can tell whether its parent died before it got the chance to set itself up.
+// (We ask the kernel directly, since getpid() may be virtualized.)
+static void PFX(mp_atfork_prepare)()
+{ mp_fork_parent = syscall(SYS_getpid); }
+
+// Runs in the parent process after each fork(). If this is the process that
+// called listen(), this spawns the watcher thread the first time around.
+static void PFX(mp_atfork_parent)()
+{
+    int expected = 0;
+    if (!mp_is_root ||
+        !atomic_compare_exchange_strong(&mp_watcher_spawned, &expected, 1))
+    { return; }
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, PFX(mp_watcher_main), NULL);
+    if (err)
+    { fatality_errno(err, "failed to spawn the watcher thread"); }
+    pthread_detach(tid);
+    log_write(&log, "the server forked. Spawned a watcher thread.");
+}
+
+// Runs in the child process after each fork(). A child of the listener process
+// dies along with it, so the server's workers don't outlive the exec. Children
+// forked further down (CGI scripts and other helpers) are left alone, since
+// the death signal is tied to the *thread* that forked them, and a worker that
+// forks from a short-lived thread would see them killed partway through.
+static void PFX(mp_atfork_child)()
+{
+    uint8_t parent_is_root = mp_is_root;
+    mp_is_root = 0;
+    if (!parent_is_root)
+    { return; }
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+    {
+        log_write(&log, C_WARN "failed to set PR_SET_PDEATHSIG in a forked "
+                  "child." C_NONE);
+        return;
+    }
+
+    // if the listener process died before the death signal was armed, it was
+    // never sent. Only go down if the parent is really gone (and not just
+    // reparented under a different PID view)
+    if (getppid() != mp_fork_parent && kill(mp_fork_parent, 0) == -1 &&
+        errno == ESRCH)
+    { _exit(EXIT_FAILURE); }
+}
+
+// Maps the shared region and registers the fork handlers. Called once, by the
+// process that calls listen(), if multi-process support was asked for.
+static void PFX(mp_init)()
+{
+    // AFL's fork server closes its pipes in each exec's process. If they're
+    // still open here, listen() was called before a deferred fork server
+    // started, so the fork server itself would become the listener process:
+    // its watcher thread would take it down at the end of the first exec, and
+    // the shared once-flag would keep every later exec from getting a
+    // controller
+    if (fcntl(AFL_FORKSRV_STATUS_FD, F_GETFD) != -1)
+    {
+        fatality("%s needs AFL's fork server to start before the server calls "
+                 "listen(). Move __AFL_INIT() before listen(), or unset %s.",
+                 GURTHANG_ENV_LIB_MULTI_PROCESS, GURTHANG_ENV_LIB_MULTI_PROCESS);
+    }
+
+    mp_region = mmap(NULL, sizeof(mp_region_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mp_region == MAP_FAILED)
+    { fatality_errno(errno, "failed to map the shared memory region"); }
+
+    atomic_init(&mp_region->controller_elected, 0);
+    if (sem_init(&mp_region->exec_done, 1, 0) == -1)
+    { fatality_errno(errno, "failed to initialize the exec semaphore"); }
+
+    mp_is_root = 1;
+    pthread_atfork(PFX(mp_atfork_prepare), PFX(mp_atfork_parent),
+                   PFX(mp_atfork_child));
+}
+
+
+// =============== Initialization and System Call Injection ================ //
+// Helper function used during the initialization process that attempts to
+// parse environment variables.
+static void PFX(init_environment_variables)()
+{
+    // set up a small array of environment variables that take in unsigned ints
+    // and their respective global fields
+    char* unsigned_int_envvars[5] = {
+        GURTHANG_ENV_LIB_SEND_BUFFSIZE,
+        GURTHANG_ENV_LIB_RECV_BUFFSIZE,
+        GURTHANG_ENV_LIB_MAX_THREADS,
+        GURTHANG_ENV_LIB_MEM_CAP_MB,
+        GURTHANG_ENV_LIB_LEAK_THRESHOLD
+    };
+    unsigned long* unsigned_int_envvars_fields[5] = {
+        &chunk_thread_write_buffsize,
+        &chunk_thread_read_buffsize,
+        &chunk_pool_max_threads,
+        &mem_cap_mb,
+        &leak_threshold
+    };
+    unsigned long unsigned_int_envvars_maximums[5] = {
+        chunk_thread_write_max_buffsize,
+        chunk_thread_read_max_buffsize,
+        chunk_pool_max_max_threads,
+        mem_cap_max_mb,
+        leak_max_threshold
+    };
+
+    for (int i = 0; i < sizeof(unsigned_int_envvars) / sizeof(char*); i++)
+    {
+        char* env_name = unsigned_int_envvars[i];
+        unsigned long* env_field = unsigned_int_envvars_fields[i];
+        unsigned long env_maximum = unsigned_int_envvars_maximums[i];
+
+        // attempt to retrieve the environment variable's value
+        char* env = getenv(env_name);
+        if (!env)
+        { continue; }
+
+        // write a message stating we found it
+        log_write(&log, "found %s%s=%s%s.",
+                LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                env_name, env,
+                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        
+        // attempt to convert the integer
+        long conversion = 0;
+        if (str_to_int(env, &conversion) || conversion <= 0)
+        {
+            fatality("%s%s%s must be set to a positive integer.",
+                    LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                    env_name,
+                    LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        }
+
+        // there's a cap, enforce it if necessary
+        if (env_maximum > 0 && conversion > env_maximum)
+        {
+            conversion = env_maximum;
+            log_write(&log, STAB_TREE1 "exceeded maximum value - capped off at %lu.",
+                      env_maximum);
+        }
+
+        // save the integer
+        *env_field = conversion;
+    }
+
+    // look for the 'NO_WAIT' environment variable. If this is defined, we'll
+    // flip a global switch that forces the controller thread to NOT wait for
+    // chunk threads as they're spawned. Instead, the controller thread will
+    // spawn all N chunk threads, *then* wait for all N of them to exit.
+    if (getenv(GURTHANG_ENV_LIB_NO_WAIT))
+    {
+        log_write(&log, "found %s%s%s. Enabling %sNO_WAIT%s mode.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_NO_WAIT,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                  LOG_NOT_USING_FILE(&log) ? C_WARN : "",
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        wait_for_chunk_threads = 0;
+    }
+
+    // look for the 'EXIT_IMMEDIATE' environment variable. If this is set, the
+    // controller thread will invoke _exit() rather than exit(), to avoid the
+    // controller thread running any registered exit handlers, which may cause
+    // issues.
+    if (getenv(GURTHANG_ENV_LIB_EXIT_IMMEDIATE))
+    {
+        log_write(&log, "found %s%s%s. The controller thread will invoke "
+                  "_exit(), rather than exit().",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_EXIT_IMMEDIATE,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        exit_immediate = 1;
+        fatality_set_exit_method(1); // make sure we _exit() on fatal errors
+    }
+
+    // look for the 'PORT_RANGE' environment variable. If this is set, chunk
+    // threads will bind their sockets to source ports within the given range
+    // (formatted as "LOW:HIGH") rather than letting the kernel pick them
+    char* port_range = getenv(GURTHANG_ENV_LIB_PORT_RANGE);
+    if (port_range)
+    {
+        log_write(&log, "found %s%s=%s%s.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_PORT_RANGE, port_range,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        unsigned int lo = 0;
+        unsigned int hi = 0;
+        char extra = 0;
+        if (sscanf(port_range, "%u:%u%c", &lo, &hi, &extra) != 2 ||
+            lo == 0 || hi > UINT16_MAX || lo > hi)
+        {
+            fatality("%s%s%s must be formatted as \"LOW:HIGH\", where "
+                     "0 < LOW <= HIGH <= %u.",
+                     LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                     GURTHANG_ENV_LIB_PORT_RANGE,
+                     LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                     UINT16_MAX);
+        }
+        port_range_lo = lo;
+        port_range_hi = hi;
+    }
+
+    // look for the 'PERF_FEEDBACK' environment variables. If these are set,
+    // the time the server takes to respond (and, optionally, the CPU time it
+    // uses) are written into AFL's coverage map at the end of the exec
+    if (getenv(GURTHANG_ENV_LIB_PERF_FEEDBACK))
+    {
+        log_write(&log, "found %s%s%s. Time-to-response will be fed back to "
+                  "AFL++.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_PERF_FEEDBACK,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        perf_feedback = 1;
+    }
+    if (getenv(GURTHANG_ENV_LIB_PERF_FEEDBACK_CPU))
+    {
+        log_write(&log, "found %s%s%s. CPU time will be fed back to AFL++.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_PERF_FEEDBACK_CPU,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        perf_feedback_cpu = 1;
+    }
+
+    // look for the 'MEM_FEEDBACK' environment variable. If this is set, the
+    // growth in peak memory is written into AFL's coverage map at the end of
+    // the exec
+    if (getenv(GURTHANG_ENV_LIB_MEM_FEEDBACK))
+    {
+        log_write(&log, "found %s%s%s. Memory growth will be fed back to "
+                  "AFL++.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_MEM_FEEDBACK,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        mem_feedback = 1;
+    }
+
+    // look for the 'COVERAGE_RESET' environment variable. If this is set, the
+    // controller thread will wipe AFL's coverage map right before it sends
+    // the first chunk
+    if (getenv(GURTHANG_ENV_LIB_COVERAGE_RESET))
+    {
+        log_write(&log, "found %s%s%s. AFL++ coverage will be reset before the "
+                  "first chunk is sent.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_COVERAGE_RESET,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        coverage_reset = 1;
+    }
+
+    // look for the 'MULTI_PROCESS' environment variable. If this is set, the
+    // processes the server forks agree on which of them runs the controller
+    if (getenv(GURTHANG_ENV_LIB_MULTI_PROCESS))
+    {
+        log_write(&log, "found %s%s%s. Forked processes will share one "
+                  "controller.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_MULTI_PROCESS,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        mp_enabled = 1;
+    }
+
+    // look for the 'DRAIN' environment variable. If this is set, the
+    // controller runs a thread that reads and discards any response bytes
+    // that no chunk is waiting for
+    if (getenv(GURTHANG_ENV_LIB_DRAIN))
+    {
+        log_write(&log, "found %s%s%s. Unawaited responses will be drained.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_DRAIN,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        drain_enabled = 1;
+    }
+
+    // look for the 'TRACE' environment variable. If this is set, a timeline
+    // of what each thread did is written to the given file at the end of the
+    // exec
+    char* trace = getenv(GURTHANG_ENV_LIB_TRACE);
+    if (trace)
+    {
+        log_write(&log, "found %s%s=%s%s.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_TRACE, trace,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        if (trace[0] == '\0')
+        {
+            fatality("%s%s%s must be a file path.",
+                     LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                     GURTHANG_ENV_LIB_TRACE,
+                     LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        }
+        trace_path = trace;
+    }
+
+    // look for the 'TLS_BYPASS' environment variable. If this is set, our
+    // versions of OpenSSL's SSL_* functions will skip the crypto entirely for
+    // comux connections and pass plaintext through
+    if (getenv(GURTHANG_ENV_LIB_TLS_BYPASS))
+    {
+        log_write(&log, "found %s%s%s. TLS will be bypassed on comux "
+                  "connections.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_TLS_BYPASS,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
+        tls_bypass = 1;
+    }
+
+    // look for the 'UPSTREAM' environment variable. If this is set, the
+    // server's connections to the given "HOST:PORT" addresses (separated by
+    // commas) go to our upstream emulator instead. A HOST of "*" matches any
+    // IPv4 address
+    char* upstream = getenv(GURTHANG_ENV_LIB_UPSTREAM);
+    if (upstream)
+    {
+        log_write(&log, "found %s%s=%s%s.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_UPSTREAM, upstream,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        char* copy = strdup(upstream);
+        char* saveptr = NULL;
+        for (char* tok = strtok_r(copy, ",", &saveptr); tok;
+             tok = strtok_r(NULL, ",", &saveptr))
+        {
+            char* colon = strrchr(tok, ':');
+            long port = 0;
+            struct sockaddr_in* addr = &upstream_addrs[upstream_addrs_len];
+            if (colon)
+            { *colon = '\0'; }
+            if (upstream_addrs_len == UPSTREAM_MAX_ADDRS || !colon ||
+                str_to_int(colon + 1, &port) || port <= 0 || port > UINT16_MAX ||
+                (strcmp(tok, "*") && inet_pton(AF_INET, tok, &addr->sin_addr) != 1))
+            {
+                fatality("%s%s%s must be a list of up to %d \"HOST:PORT\" "
+                         "IPv4 addresses, separated by commas.",
+                         LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                         GURTHANG_ENV_LIB_UPSTREAM,
+                         LOG_NOT_USING_FILE(&log) ? C_NONE : "",
+                         UPSTREAM_MAX_ADDRS);
+            }
+            if (!strcmp(tok, "*"))
+            { addr->sin_addr.s_addr = htonl(INADDR_ANY); }
+            addr->sin_family = AF_INET;
+            addr->sin_port = htons(port);
+            upstream_addrs_len++;
+        }
+        free(copy);
+    }
+
+    // look for the 'UPSTREAM_RESPONSE' environment variable. If this is set,
+    // the file's contents are what the upstream emulator answers with once
+    // it runs out of UPSTREAM chunks
+    char* upstream_file = getenv(GURTHANG_ENV_LIB_UPSTREAM_RESPONSE);
+    if (upstream_file)
+    {
+        log_write(&log, "found %s%s=%s%s.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_UPSTREAM_RESPONSE, upstream_file,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
+        int fd = open(upstream_file, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        { fatality_errno(errno, "failed to open %s", upstream_file); }
+        upstream_response = alloc_check(UPSTREAM_RESPONSE_MAXLEN);
+        ssize_t rcount = 0;
+        while (upstream_response_len < UPSTREAM_RESPONSE_MAXLEN &&
+               (rcount = read(fd, upstream_response + upstream_response_len,
+                              UPSTREAM_RESPONSE_MAXLEN - upstream_response_len)) > 0)
+        { upstream_response_len += rcount; }
+        if (rcount == -1)
+        { fatality_errno(errno, "failed to read %s", upstream_file); }
+        close(fd);
+    }
+}
+
+// ========================== Determinism Layer =========================== //
+// With GURTHANG_LIB_DETERMINISM set, we interpose the usual sources of
+// run-to-run noise: the wall clock, the kernel's random number sources, libc's
+// PRNG, and (optionally) getpid(). Each of them returns values derived from a
+// seed, and everything is reset at the start of each exec (when the library is
+// loaded, and in the child after every fork(), which is how AFL's fork server
+// starts each exec). Identical comux inputs then see identical values.
+//
+// The wall clock starts at a fixed epoch and advances with the real monotonic
+// clock, so timeouts in the server still fire. Random bytes come from a
+// splitmix64 generator that all threads share. Monotonic clocks are left alone.
+#define DET_EPOCH 1600000000            // the wall clock's starting point
+#define DET_URANDOM_LEN (1 << 16)       // bytes behind each /dev/urandom fd
+#define DET_GOLDEN 0x9e3779b97f4a7c15ull // splitmix64's increment
+
+static _Atomic uint64_t det_state = 0; // shared PRNG state
+static struct timespec det_start;       // monotonic time at the exec's start
+
+// Real libc functions. These can be called before our constructor runs (by
+// other libraries' constructors), so each hook resolves its function lazily.
+static time_t (*real_time) (time_t*);
+static int (*real_gettimeofday) (struct timeval*, void*);
+static int (*real_clock_gettime) (clockid_t, struct timespec*);
+static ssize_t (*real_getrandom) (void*, size_t, unsigned int);
+static int (*real_getentropy) (void*, size_t);
+static int (*real_open) (const char*, int, ...);
+static int (*real_open64) (const char*, int, ...);
+static int (*real_openat) (int, const char*, int, ...);
+static FILE* (*real_fopen) (const char*, const char*);
+static FILE* (*real_fopen64) (const char*, const char*);
+static int (*real_rand) (void);
+static long (*real_random) (void);
+static pid_t (*real_getpid) (void);
+#define det_real(name) \
+    ((__typeof__(real_##name)) PFX(det_resolve)((void**) &real_##name, #name))
+
+// Returns the real function stored at the given pointer, looking it up first
+// if needed.
+static inline void* PFX(det_resolve)(void** fn, const char* name)
+{
+    if (!*fn)
+    { *fn = dlsym(RTLD_NEXT, name); }
+    return *fn;
+}
+
+// Mixes a 64-bit value with splitmix64's finalizer.
+static inline uint64_t PFX(det_mix)(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Returns the next 64 random bits from the shared generator.
+static inline uint64_t PFX(det_next)()
+{ return PFX(det_mix)(atomic_fetch_add(&det_state, DET_GOLDEN) + DET_GOLDEN); }
+
+// Fills the given buffer with random bytes from the shared generator.
+static void PFX(det_fill)(void* buff, size_t len)
+{
+    uint8_t* bytes = buff;
+    while (len > 0)
+    {
+        uint64_t r = PFX(det_next)();
+        size_t n = MIN(len, sizeof(uint64_t));
+        memcpy(bytes, &r, n);
+        bytes += n;
+        len -= n;
+    }
+}
+
+// Resets the generator and the wall clock. Done at load time and in the child
+// after each fork().
+static void PFX(det_reset)()
+{
+    atomic_store(&det_state, det_seed);
+    det_real(clock_gettime)(CLOCK_MONOTONIC, &det_start);
+}
+
+// Returns the current (virtual) wall clock time.
+static void PFX(det_now)(struct timespec* ts)
+{
+    struct timespec now;
+    det_real(clock_gettime)(CLOCK_MONOTONIC, &now);
+    int64_t nsec = (now.tv_sec - det_start.tv_sec) * 1000000000ll +
+                   (now.tv_nsec - det_start.tv_nsec);
+    ts->tv_sec = DET_EPOCH + (nsec / 1000000000ll);
+    ts->tv_nsec = nsec % 1000000000ll;
+}
+
+// Returns a file descriptor whose contents are a fixed amount of random bytes
+// from the shared generator. Handed out in place of /dev/urandom.
+static int PFX(det_urandom_fd)(int flags)
+{
+    int fd = memfd_create("gurthang-urandom", (flags & O_CLOEXEC) ? MFD_CLOEXEC : 0);
+    if (fd == -1)
+    { return -1; }
+
+    char buff[4096];
+    for (size_t i = 0; i < DET_URANDOM_LEN; i += sizeof(buff))
+    {
+        PFX(det_fill)(buff, sizeof(buff));
+        if (write(fd, buff, sizeof(buff)) != sizeof(buff))
+        { fatality_errno(errno, "failed to fill deterministic /dev/urandom"); }
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Returns non-zero if the given path is one of the kernel's random devices.
+static inline uint8_t PFX(det_is_random_device)(const char* path)
+{
+    return det_enabled && path &&
+           (!strcmp(path, "/dev/urandom") || !strcmp(path, "/dev/random"));
+}
+
+// Reads the determinism environment variables and, if enabled, sets the layer
+// up. Called from the library's constructor.
+static void PFX(det_init)()
+{
+    char* env = getenv(GURTHANG_ENV_LIB_DETERMINISM);
+    if (!env)
+    { return; }
+
+    long conversion = 0;
+    if (str_to_int(env, &conversion) || conversion < 0)
+    {
+        fatality("%s must be set to a non-negative integer (the seed).",
+                 GURTHANG_ENV_LIB_DETERMINISM);
+    }
+    det_seed = PFX(det_mix)(conversion);
+    det_pid_enabled = getenv(GURTHANG_ENV_LIB_DETERMINISM_PID) != NULL;
+    det_enabled = 1;
+
+    PFX(det_reset)();
+    pthread_atfork(NULL, NULL, PFX(det_reset));
+}
+
+time_t time(time_t* tloc)
+{
+    if (!det_enabled)
+    { return det_real(time)(tloc); }
+
+    struct timespec ts;
+    PFX(det_now)(&ts);
+    if (tloc)
+    { *tloc = ts.tv_sec; }
+    return ts.tv_sec;
+}
+
+#if __GLIBC_PREREQ(2, 31)
+int gettimeofday(struct timeval* restrict tv, void* restrict tz)
+#else
+int gettimeofday(struct timeval* restrict tv, struct timezone* restrict tz)
+#endif
+{
+    if (!det_enabled)
+    { return det_real(gettimeofday)(tv, tz); }
+
+    // 'tv' may be NULL if the caller only wants the timezone. (glibc marks it
+    // as non-null, so it's copied into a volatile to keep the check around.)
+    struct timeval* volatile out = tv;
+    struct timespec ts;
+    PFX(det_now)(&ts);
+    if (out)
+    {
+        out->tv_sec = ts.tv_sec;
+        out->tv_usec = ts.tv_nsec / 1000;
+    }
+    return 0;
+}
+
+int clock_gettime(clockid_t clockid, struct timespec* tp)
+{
+    if (!det_enabled ||
+        (clockid != CLOCK_REALTIME && clockid != CLOCK_REALTIME_COARSE))
+    { return det_real(clock_gettime)(clockid, tp); }
+
+    PFX(det_now)(tp);
+    return 0;
+}
+
+ssize_t getrandom(void* buff, size_t buflen, unsigned int flags)
+{
+    if (!det_enabled)
+    { return det_real(getrandom)(buff, buflen, flags); }
+
+    PFX(det_fill)(buff, buflen);
+    return buflen;
+}
+
+int getentropy(void* buff, size_t length)
+{
+    if (!det_enabled)
+    { return det_real(getentropy)(buff, length); }
+
+    // getentropy() refuses requests larger than 256 bytes
+    if (length > 256)
+    {
+        errno = EIO;
+        return -1;
+    }
+    PFX(det_fill)(buff, length);
+    return 0;
+}
+
+// Helper for the open() family: pulls the optional 'mode' argument out of the
+// variable argument list, if the flags say it's there. (O_TMPFILE includes the
+// O_DIRECTORY bit, so all of its bits have to be set to count.)
+#define det_open_mode(flags, last, mode) do                         \
+    {                                                               \
+        if (((flags) & O_CREAT) ||                                  \
+            ((flags) & O_TMPFILE) == O_TMPFILE)                     \
+        {                                                           \
+            va_list args;                                           \
+            va_start(args, last);                                   \
+            mode = va_arg(args, mode_t);                            \
+            va_end(args);                                           \
+        }                                                           \
+    } while (0)
+
+int open(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    det_open_mode(flags, flags, mode);
+    if (PFX(det_is_random_device)(path))
+    { return PFX(det_urandom_fd)(flags); }
+    return det_real(open)(path, flags, mode);
+}
+
+int open64(const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    det_open_mode(flags, flags, mode);
+    if (PFX(det_is_random_device)(path))
+    { return PFX(det_urandom_fd)(flags); }
+    return det_real(open64)(path, flags, mode);
+}
+
+int openat(int dirfd, const char* path, int flags, ...)
+{
+    mode_t mode = 0;
+    det_open_mode(flags, flags, mode);
+    if (PFX(det_is_random_device)(path))
+    { return PFX(det_urandom_fd)(flags); }
+    return det_real(openat)(dirfd, path, flags, mode);
+}
+
+FILE* fopen(const char* restrict path, const char* restrict mode)
+{
+    if (PFX(det_is_random_device)(path))
+    {
+        int fd = PFX(det_urandom_fd)(strchr(mode, 'e') ? O_CLOEXEC : 0);
+        return fd == -1 ? NULL : fdopen(fd, "r");
+    }
+    return det_real(fopen)(path, mode);
+}
+
+FILE* fopen64(const char* restrict path, const char* restrict mode)
+{
+    if (PFX(det_is_random_device)(path))
+    {
+        int fd = PFX(det_urandom_fd)(strchr(mode, 'e') ? O_CLOEXEC : 0);
+        return fd == -1 ? NULL : fdopen(fd, "r");
+    }
+    return det_real(fopen64)(path, mode);
+}
+
+int rand(void)
+{
+    if (!det_enabled)
+    { return det_real(rand)(); }
+    return (int) (PFX(det_next)() >> 33); // [0, RAND_MAX]
+}
+
+long random(void)
+{
+    if (!det_enabled)
+    { return det_real(random)(); }
+    return (long) (PFX(det_next)() >> 33);
+}
+
+// getpid() is only virtualized when GURTHANG_LIB_DETERMINISM_PID is also set.
+// Servers that fork() and keep track of their children by PID (like Apache's
+// prefork MPM) will get confused if every process reports the same PID.
+pid_t getpid(void)
+{
+    if (!det_pid_enabled)
+    { return det_real(getpid)(); }
+    return 1000 + (PFX(det_mix)(det_seed) % 30000);
+}
+
+// ============================ Port Remapping ============================= //
+// Every instance of a target server binds the same configured port, so only
+// one can run on a machine at a time. With GURTHANG_LIB_BIND_REMAP set to a
+// list of "FROM:TO" pairs, our bind() swaps a TCP socket's requested port FROM
+// for port TO. A FROM of "*" matches any port, and a TO of 0 lets the kernel
+// pick a free one. The chunk threads find the server's port with
+// getsockname(), so they follow along without any extra work.
+//
+// Servers usually bind before they call listen(), so this is set up when the
+// library is loaded (like the determinism layer), not in PFX(init).
+#define BIND_REMAP_ANY -1 // a 'from' port that matches any port
+
+// Reads GURTHANG_LIB_BIND_REMAP. Called from the library's constructor.
+static void PFX(bind_remap_init)()
+{
+    char* env = getenv(GURTHANG_ENV_LIB_BIND_REMAP);
+    if (!env)
+    { return; }
+
+    char* copy = strdup(env);
+    char* saveptr = NULL;
+    for (char* tok = strtok_r(copy, ",", &saveptr); tok;
+         tok = strtok_r(NULL, ",", &saveptr))
+    {
+        unsigned int from = 0;
+        unsigned int to = 0;
+        char extra = 0;
+        uint8_t any = sscanf(tok, "*:%u%c", &to, &extra) == 1;
+        if (bind_remaps_len == BIND_REMAP_MAX ||
+            (!any && (sscanf(tok, "%u:%u%c", &from, &to, &extra) != 2 ||
+                      from == 0 || from > UINT16_MAX)) ||
+            to > UINT16_MAX)
+        {
+            fatality("%s must be a list of up to %d \"FROM:TO\" port pairs, "
+                     "separated by commas.", GURTHANG_ENV_LIB_BIND_REMAP,
+                     BIND_REMAP_MAX);
+        }
+        bind_remaps[bind_remaps_len].from = any ? BIND_REMAP_ANY : (int32_t) from;
+        bind_remaps[bind_remaps_len].to = to;
+        bind_remaps_len++;
+    }
+    free(copy);
+}
+
+// Overloads the bind() system call. TCP sockets bound to one of the ports
+// we're remapping are bound to the new port instead. Anything else (including
+// sockets asking for an ephemeral port already) passes straight through.
+int bind(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    if (!bind_remaps_len || !addr || addrlen > sizeof(struct sockaddr_storage))
+    { return real_bind(sockfd, addr, addrlen); }
+
+    // find the port in our own copy of the address
+    struct sockaddr_storage copy;
+    memcpy(&copy, addr, addrlen);
+    in_port_t* port = NULL;
+    if (addr->sa_family == AF_INET && addrlen >= sizeof(struct sockaddr_in))
+    { port = &((struct sockaddr_in*) &copy)->sin_port; }
+    else if (addr->sa_family == AF_INET6 && addrlen >= sizeof(struct sockaddr_in6))
+    { port = &((struct sockaddr_in6*) &copy)->sin6_port; }
+    int type = 0;
+    socklen_t type_len = sizeof(type);
+    if (!port || *port == 0 ||
+        getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &type_len) ||
+        type != SOCK_STREAM)
+    { return real_bind(sockfd, addr, addrlen); }
+
+    for (uint32_t i = 0; i < bind_remaps_len; i++)
+    {
+        if (bind_remaps[i].from == BIND_REMAP_ANY ||
+            bind_remaps[i].from == ntohs(*port))
+        {
+            *port = htons(bind_remaps[i].to);
+            return real_bind(sockfd, (struct sockaddr*) &copy, addrlen);
+        }
+    }
+    return real_bind(sockfd, addr, addrlen);
+}
+
+
+
+// Helper function that looks up the real version of one of the system calls we
+// overload. Exits on failure.
+static void* PFX(resolve_symbol)(const char* name)
+{
+    void* sym = dlsym(RTLD_NEXT, name);
+    if (!sym)
+    { fatality("failed to look up '%s' system call", name); }
+    return sym;
+}
+
+// Runs when the library is loaded, before the target's main(). We look up all
+// the real system calls here, once, so none of our injected versions need to
+// check (or lock around) whether they've been resolved yet.
+static void __attribute__((constructor)) PFX(load)()
+{
+    real_accept = PFX(resolve_symbol)("accept");
+    real_accept4 = PFX(resolve_symbol)("accept4");
+    real_listen = PFX(resolve_symbol)("listen");
+    real_epoll_ctl = PFX(resolve_symbol)("epoll_ctl");
+    real_epoll_wait = PFX(resolve_symbol)("epoll_wait");
+    real_epoll_pwait = PFX(resolve_symbol)("epoll_pwait");
+#if __GLIBC_PREREQ(2, 35)
+    // (this one is newer, so it's alright if the C library doesn't have it)
+    real_epoll_pwait2 = dlsym(RTLD_NEXT, "epoll_pwait2");
+#endif
+    real_syscall = PFX(resolve_symbol)("syscall");
+    real_connect = PFX(resolve_symbol)("connect");
+    real_bind = PFX(resolve_symbol)("bind");
+    real_close = PFX(resolve_symbol)("close");
+
+    // the determinism layer has to be up and running before the server's
+    // main() starts asking for the time or random numbers, so we set it up
+    // here rather than in PFX(init)
+    PFX(det_init)();
+
+    // the same goes for port remapping, since servers bind() their listener
+    // sockets before they call listen()
+    PFX(bind_remap_init)();
+}
+
+// The initialization function for the library. Called a single time by the
+// first thread that calls listen(). Takes in the socket file descriptor the
+// target server is accepting connections on.
+static void PFX(init)(int sockfd)
+{
+    log_init(&log, "gurthang-lib", GURTHANG_ENV_LIB_LOG);
+
+    // check other environment variables
+    PFX(init_environment_variables)();
+
+    // save the socket file descriptor. The set of epoll FDs watching it needs
+    // to be ready first, since epoll_ctl() starts looking for it right away
+    PFX(fdset_init)(&epoll_fds);
+    accept_sock = sockfd;
+
+    // set up the shared memory region, if the server forks its workers
+    if (mp_enabled)
+    { PFX(mp_init)(); }
+
+    // report on the determinism layer, which was set up at load time
+    if (det_enabled)
+    {
+        log_write(&log, "found %s%s%s. Time and randomness are derived from "
+                  "seed %lu.%s",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_DETERMINISM,
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "",
+                  det_seed, det_pid_enabled ? " getpid() is virtualized." : "");
+    }
+
+    // report on port remapping, which was also set up at load time. By now
+    // the listener has been bound, so we can say where it ended up
+    if (bind_remaps_len)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        uint16_t port = 0;
+        if (getsockname(sockfd, (struct sockaddr*) &addr, &addr_len) == 0)
+        {
+            port = ntohs(addr.ss_family == AF_INET6 ?
+                         ((struct sockaddr_in6*) &addr)->sin6_port :
+                         ((struct sockaddr_in*) &addr)->sin_port);
+        }
+        log_write(&log, "found %s%s=%s%s. The listener socket is bound to "
+                  "port %u.",
+                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
+                  GURTHANG_ENV_LIB_BIND_REMAP, getenv(GURTHANG_ENV_LIB_BIND_REMAP),
+                  LOG_NOT_USING_FILE(&log) ? C_NONE: "", port);
+    }
+
+    // report the real system calls we looked up when the library was loaded
+    log_write(&log, "found real system calls: accept=%p, accept4=%p, "
+              "listen=%p, epoll_ctl=%p, epoll_wait=%p, epoll_pwait=%p",
+              real_accept, real_accept4, real_listen,
+              real_epoll_ctl, real_epoll_wait, real_epoll_pwait);
+
+    // initialize the connection table lock (the table itself is allocated by
+    // the controller thread, once it knows how many connections there are)
+    pthread_mutex_init(&ctable_lock, NULL);
+
+    // we only need the listener's address if we're going to treat comux
+    // connections specially. Every connection accepted on it has the same
+    // local address, however it was accepted
+    if (tls_bypass)
+    {
+        tls_listen_addr_len = sizeof(tls_listen_addr);
+        if (getsockname(sockfd, (struct sockaddr*) &tls_listen_addr,
+                        &tls_listen_addr_len) == -1)
+        { fatality_errno(errno, "failed to get the listener socket's address"); }
+    }
+}
+
+// ========================== Listener Discovery =========================== //
+// The library normally initializes itself when the server calls listen().
+// Servers that are handed a socket that's already listening (systemd-style
+// socket activation, or a launcher that binds the listener and then starts
+// the server) never call it. For these, the first time the server reaches one
+// of our other hooks, we go looking for the listener:
+//  1. If LISTEN_FDS is set (and LISTEN_PID, if set, is this process), we take
+//     the first listening TCP socket passed in, starting at fd 3.
+//  2. Otherwise, we take the lowest-numbered listening TCP socket the process
+//     has open.
+// We don't do this when the library is loaded. At that point AFL's fork server
+// hasn't started, and everything PFX(init) sets up has to be made fresh in
+// each exec.
+#define LISTEN_FDS_START 3 // (SD_LISTEN_FDS_START)
+static atomic_int lib_initialized = 0; // once-flag for PFX(init)
+static atomic_int discovery_done = 0; // once-flag for listener discovery
+
+// Initializes the library with the given listener socket, unless it's already
+// been initialized.
+static void PFX(init_once)(int sockfd, const char* via)
+{
+    pthread_mutex_lock(&alock);
+    if (!atomic_load(&lib_initialized))
+    {
+        PFX(init)(sockfd);
+        log_write(&log, "found listener socket %d (via %s).", sockfd, via);
+        atomic_store(&lib_initialized, 1);
+    }
+    pthread_mutex_unlock(&alock);
+}
+
+// Returns non-zero if the given file descriptor is a listening TCP socket.
+static uint8_t PFX(is_listener)(int fd)
+{
+    int val = 0;
+    socklen_t val_len = sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &val_len) || !val)
+    { return 0; }
+    val_len = sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &val, &val_len) ||
+        val != SOCK_STREAM)
+    { return 0; }
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr*) &addr, &addr_len))
+    { return 0; }
+    return addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+}
+
+// Looks for a listener socket the server was given when it started (see
+// above), and initializes the library with it. Only the first call does any
+// work.
+static void PFX(discover)()
+{
+    int expected = 0;
+    if (atomic_load_explicit(&lib_initialized, memory_order_acquire) ||
+        !atomic_compare_exchange_strong(&discovery_done, &expected, 1))
+    { return; }
+
+    // first, try the sockets passed in by a socket-activation launcher
+    char* listen_fds = getenv("LISTEN_FDS");
+    char* listen_pid = getenv("LISTEN_PID");
+    long count = 0;
+    long pid = 0;
+    if (listen_fds && !str_to_int(listen_fds, &count) && count > 0 &&
+        (!listen_pid || (!str_to_int(listen_pid, &pid) &&
+                         pid == syscall(SYS_getpid))))
+    {
+        for (int fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + count; fd++)
+        {
+            if (PFX(is_listener)(fd))
+            {
+                PFX(init_once)(fd, "LISTEN_FDS");
+                return;
+            }
+        }
+    }
+
+    // otherwise, look through every file descriptor we have open
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir)
+    { return; }
+    int lowest = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        long fd = 0;
+        if (entry->d_name[0] == '.' || str_to_int(entry->d_name, &fd) ||
+            fd == dirfd(dir) || (lowest != -1 && fd > lowest))
+        { continue; }
+        if (PFX(is_listener)(fd))
+        { lowest = fd; }
+    }
+    closedir(dir);
+    if (lowest != -1)
+    { PFX(init_once)(lowest, "an inherited file descriptor"); }
+}
+
+// Makes sure the library has been initialized before one of our hooks goes
+// any further. Cheap once it has been.
+#define lib_discover() do {                                             \
+        if (!atomic_load_explicit(&lib_initialized, memory_order_acquire)) \
+        { PFX(discover)(); }                                            \
+    } while (0)
+
+
+// ========================= System Call Injection ========================= //
+// This overloads the listen() system call. We use this simply to capture the
+// server's listener socket for later use.
+int listen(int sockfd, int backlog)
+{
+    // we'll only initialize once, for the first socket the server listens on
+    if (!atomic_load_explicit(&lib_initialized, memory_order_acquire))
+    { PFX(init_once)(sockfd, "listen"); }
+
+    // invoke the REAL listen() system call
+    return real_listen(sockfd, backlog);
+}
+
+// Overloads epoll_ctl() system call. We overload this in order to keep track
+// of every epoll file descriptor the server's listener socket is added to (or
+// removed from).
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event)
+{
+    // call the original epoll_ctl(). We only keep track of changes that
+    // actually happened
+    int ret = real_epoll_ctl(epfd, op, fd, event);
+    if (ret == -1)
+    { return ret; }
+
+    // if the accept socket hasn't been saved yet (via our injected listen()
+    // system call), see if the server was handed one. If not, log this (this
+    // might happen if an unrelated epoll set is created before listen() is
+    // invoked)
+    lib_discover();
+    if (accept_sock == -1)
+    {
+        log_write(&log, C_WARN "epoll_ctl() invoked before the listener "
+                  "socket was discovered." C_NONE);
+    }
+    // otherwise, check to see if this epoll set is having the listener
+    // socket added to (or removed from) it. If so, we're interested
+    else if (fd == accept_sock && op == EPOLL_CTL_DEL)
+    {
+        PFX(fdset_remove)(&epoll_fds, epfd);
+        log_write(&log, "listener socket removed from epoll FD: %d", epfd);
+    }
+    else if (fd == accept_sock && !PFX(fdset_has)(&epoll_fds, epfd))
+    {
+        PFX(fdset_add)(&epoll_fds, epfd);
+        log_write(&log, "found listener socket epoll FD: %d", epfd);
+    }
+    return ret;
+}
+
+// Overloads epoll_wait() system call. We overload this in the event the server
+// has an epoll file descriptor used to monitor the listener socket. A thread
+// for such a server might call epoll_wait() before it calls accept(). If this
+// library simply blocked on accept(), it would never know the threads are
+// stuck in epoll_wait() waiting for a connection to be made.
+int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+{
+    // if this epoll FD is watching the listener socket, we'll spawn the
+    // controller (if it hasn't been spawned already). This is done without
+    // any locking, since epoll_wait() sits in the server's hot loop
+    if (!controller_spawned() && PFX(fdset_has)(&epoll_fds, epfd))
+    { PFX(controller_spawn_once)("epoll_wait"); }
+
+    // invoke and return the real epoll_wait()
+    return real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+// Overloads epoll_pwait(), which some event loops (such as libuv's) use in
+// place of epoll_wait(). Behaves exactly the same as our epoll_wait().
+int epoll_pwait(int epfd, struct epoll_event* events, int maxevents,
+                int timeout, const sigset_t* sigmask)
+{
+    if (!controller_spawned() && PFX(fdset_has)(&epoll_fds, epfd))
+    { PFX(controller_spawn_once)("epoll_pwait"); }
+    return real_epoll_pwait(epfd, events, maxevents, timeout, sigmask);
+}
+
+#if __GLIBC_PREREQ(2, 35)
+// Overloads epoll_pwait2(), which takes a timespec rather than milliseconds.
+// Behaves exactly the same as our epoll_wait().
+int epoll_pwait2(int epfd, struct epoll_event* events, int maxevents,
+                 const struct timespec* timeout, const sigset_t* sigmask)
+{
+    if (!controller_spawned() && PFX(fdset_has)(&epoll_fds, epfd))
+    { PFX(controller_spawn_once)("epoll_pwait2"); }
+    if (!real_epoll_pwait2)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+    return real_epoll_pwait2(epfd, events, maxevents, timeout, sigmask);
+}
+#endif
+
+// The definition for our own version of the accept() system call. The target
+// server's thread will call this, run some extra library code, then make a
+// call to the REAL accept() and return its value.
+int accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen)
+{
+    // spawn the controller thread, if we haven't done so already. If the
+    // server never called listen(), find its listener first (failing that,
+    // the socket it's accepting on is surely one)
+    if (!controller_spawned())
+    {
+        lib_discover();
+        if (!atomic_load_explicit(&lib_initialized, memory_order_acquire))
+        { PFX(init_once)(sockfd, "accept"); }
+        PFX(controller_spawn_once)("accept");
+    }
+
+    // invoke the REAL system call
+    return real_accept(sockfd, addr, addrlen);
+}
+
+// Definition of our own version of accept4(). Behaves exactly the same as our
+// version of accept(). Initializes the controller thread if applicable, then
+// makes a call to the REAL accept4().
+int accept4(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags)
+{
+    // spawn the controller thread if it has yet to be done (finding the
+    // listener first, just like accept())
+    if (!controller_spawned())
+    {
+        lib_discover();
+        if (!atomic_load_explicit(&lib_initialized, memory_order_acquire))
+        { PFX(init_once)(sockfd, "accept4"); }
+        PFX(controller_spawn_once)("accept4");
+    }
+
+    // invoke the real accept4()
+    return real_accept4(sockfd, addr, addrlen, flags);
+}
+
+// Overloads the connect() system call. If the server is connecting to one of
+// the upstream addresses we're emulating, the connection is sent to our
+// upstream emulator instead (see the "Upstream Emulator" section).
+int connect(int sockfd, const struct sockaddr* addr, socklen_t addrlen)
+{
+    if (upstream_addrs_len && PFX(upstream_match)(addr, addrlen))
+    {
+        pthread_once(&upstream_start_once, PFX(upstream_start));
+        return real_connect(sockfd, (const struct sockaddr*) &upstream_sock_addr,
+                            sizeof(upstream_sock_addr));
+    }
+    return real_connect(sockfd, addr, addrlen);
+}
+
+// Overloads close(). File descriptor numbers get reused, so once the server
+// closes an epoll instance watching the listener socket (which is usually
+// disposed of without an EPOLL_CTL_DEL), we forget about it before the number
+// can be handed out again.
+int close(int fd)
+{
+    PFX(fdset_remove)(&epoll_fds, fd);
+
+    // (other libraries' constructors can close files before ours has run)
+    if (!real_close)
+    { real_close = PFX(resolve_symbol)("close"); }
+    return real_close(fd);
+}
+
+
+// =========================== io_uring Detection ========================== //
+// Servers built on io_uring never call accept(). Instead, they place an
+// IORING_OP_ACCEPT submission queue entry (SQE) on a ring and hand it to the
+// kernel with io_uring_enter(). To spawn the controller at the right moment,
+// we peek at each batch of SQEs just before it's submitted and look for an
+// accept on the listener socket.
+//
+// There are two ways a batch reaches the kernel:
+//  1. The server calls syscall(__NR_io_uring_enter, ...) itself. We interpose
+//     syscall(), watch io_uring_setup() to map our own read-only view of each
+//     new ring's submission queue, then scan the queue on io_uring_enter().
+//  2. The server uses liburing, which issues the system call with its own
+//     inline assembly. For this, we interpose liburing's io_uring_submit*()
+//     functions and scan the (not yet flushed) entries in the struct io_uring
+//     the server passes in.
+// Rings set up with IORING_SETUP_SQPOLL never enter the kernel to submit, and
+// a statically-linked liburing can't be interposed. For these servers, the
+// controller is still spawned by epoll_wait() or accept() if they're called.
+#ifndef IORING_SETUP_NO_SQARRAY
+#define IORING_SETUP_NO_SQARRAY (1U << 16)
+#endif
+#define URING_MAX_RINGS 64 // number of raw rings we'll keep track of
+
+// Our view of a ring created through a raw io_uring_setup() call.
+typedef struct uring_ring
+{
+    atomic_int fd;              // ring file descriptor
+    const _Atomic uint32_t* khead; // kernel-side SQ head
+    const uint32_t* ktail;      // server-side SQ tail
+    uint32_t mask;              // SQ ring mask
+    uint32_t entries;           // SQ ring size
+    const uint32_t* array;      // SQ index array (NULL with NO_SQARRAY)
+    const uint8_t* sqes;        // the SQEs themselves
+    size_t sqe_size;            // 64 bytes, or 128 with IORING_SETUP_SQE128
+} uring_ring_t;
+static uring_ring_t uring_rings[URING_MAX_RINGS];
+static atomic_uint uring_rings_len = 0;
+static pthread_mutex_t uring_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The leading fields of liburing's 'struct io_uring', up to the ring's setup
+// flags. liburing has padded these structs to keep this layout fixed since
+// 2.0 (and IORING_SETUP_SQE128 rings need liburing 2.2 or newer anyway).
+struct io_uring_sq
+{
+    unsigned* khead;
+    unsigned* ktail;
+    unsigned* kring_mask;       // deprecated (but still set) in liburing 2.x
+    unsigned* kring_entries;
+    unsigned* kflags;
+    unsigned* kdropped;
+    unsigned* array;
+    struct io_uring_sqe* sqes;
+    unsigned sqe_head;          // first SQE not yet flushed to the kernel
+    unsigned sqe_tail;          // one past the last SQE handed out
+    size_t ring_sz;
+    void* ring_ptr;
+    unsigned pad[4];            // ring_mask and ring_entries in liburing 2.3+
+};
+struct io_uring_cq
+{
+    unsigned* khead;
+    unsigned* ktail;
+    unsigned* kring_mask;
+    unsigned* kring_entries;
+    unsigned* kflags;
+    unsigned* koverflow;
+    struct io_uring_cqe* cqes;
+    size_t ring_sz;
+    void* ring_ptr;
+    unsigned pad[4];
+};
+struct io_uring
+{
+    struct io_uring_sq sq;
+    struct io_uring_cq cq;
+    unsigned flags;             // the IORING_SETUP_* flags the ring was made with
+};
+
+// Real versions of liburing's submission functions. These are resolved
+// lazily, the same way we handle OpenSSL.
+static int (*real_io_uring_submit) (struct io_uring*);
+static int (*real_io_uring_submit_and_wait) (struct io_uring*, unsigned);
+static int (*real_io_uring_submit_and_wait_timeout)
+    (struct io_uring*, void**, unsigned, void*, void*);
+static int (*real_io_uring_submit_and_get_events) (struct io_uring*);
+static pthread_once_t uring_resolve_once = PTHREAD_ONCE_INIT;
+
+// Returns non-zero if the given SQE accepts connections on the listener. We
+// can't see through registered files, so fixed-file accepts count too.
+static inline uint8_t PFX(uring_sqe_is_accept)(const struct io_uring_sqe* sqe)
+{
+    return sqe->opcode == IORING_OP_ACCEPT &&
+           (sqe->fd == accept_sock || (sqe->flags & IOSQE_FIXED_FILE));
+}
+
+// Invoked just after a successful io_uring_setup(). Maps a read-only view of
+// the new ring's submission queue and SQE array so we can inspect them later.
+static void PFX(uring_track)(int fd, const struct io_uring_params* p)
+{
+    if (p->flags & IORING_SETUP_SQPOLL)
+    {
+        log_write(&log, C_WARN "io_uring %d uses SQPOLL. Its accept SQEs "
+                  "can't be seen." C_NONE, fd);
+        return;
+    }
 
-    // the first thing we'll do is read the comux header from stdin
-    comux_manifest_t manifest;
-    comux_manifest_init(&manifest);
-    comux_parse_result_t res = comux_header_read(&manifest.header, STDIN_FILENO);
-    if (res)
+    size_t sqe_size = (p->flags & IORING_SETUP_SQE128) ? 128 : 64;
+    uint8_t no_array = (p->flags & IORING_SETUP_NO_SQARRAY) != 0;
+    size_t ring_len = no_array ? p->sq_off.ring_entries + sizeof(uint32_t) :
+                      p->sq_off.array + p->sq_entries * sizeof(uint32_t);
+    size_t sqes_len = p->sq_entries * sqe_size;
+    // IORING_FEAT_SINGLE_MMAP maps the SQ ring and CQ ring together, but the
+    // SQ ring is still at IORING_OFF_SQ_RING, which is all we need
+    uint8_t* ring = mmap(NULL, ring_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED)
+    { return; }
+    uint8_t* sqes = mmap(NULL, sqes_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+                         fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
     {
-        fatality("failed to parse comux header: %s",
-                 comux_parse_result_string(res));
+        munmap(ring, ring_len);
+        return;
     }
-    ctl_log(&log, STAB_TREE2 "found comux formatting with "
-            "%u connection(s) and %u chunk(s).",
-            manifest.header.num_conns, manifest.header.num_chunks);
-    
-    // if the number of connections within the file exceeds our maximum,
-    // complain and exit
-    if (manifest.header.num_conns > CTABLE_MAXLEN)
+
+    pthread_mutex_lock(&uring_rings_lock);
+    uint32_t len = atomic_load(&uring_rings_len);
+    // reuse a slot left behind by a ring whose fd number has come around again
+    uint32_t slot = len;
+    for (uint32_t i = 0; i < len; i++)
     {
-        fatality("the given comux file exceeds the maximum number of connections (%u)",
-                 CTABLE_MAXLEN);
+        if (uring_rings[i].fd == fd)
+        { slot = i; }
     }
-    
-    // grab the number of chunks and make sure it doesn't exceed our maximum
-    // value. If it's all good, wipe the manifest field (since it'll be
-    // incremented in the loop below)
-    uint32_t num_chunks = manifest.header.num_chunks;
-    if (num_chunks > CHUNKS_MAX)
+    if (slot < URING_MAX_RINGS)
     {
-        fatality("the given comux file exceeds the maximum number of chunks (%u)",
-                 CHUNKS_MAX);
+        uring_ring_t* r = &uring_rings[slot];
+        r->fd = -1; // hide the slot from io_uring_enter() while we fill it in
+        r->khead = (const _Atomic uint32_t*) (ring + p->sq_off.head);
+        r->ktail = (const uint32_t*) (ring + p->sq_off.tail);
+        r->mask = *(const uint32_t*) (ring + p->sq_off.ring_mask);
+        r->entries = *(const uint32_t*) (ring + p->sq_off.ring_entries);
+        r->array = no_array ? NULL : (const uint32_t*) (ring + p->sq_off.array);
+        r->sqes = sqes;
+        r->sqe_size = sqe_size;
+        atomic_store(&r->fd, fd);
+        if (slot == len)
+        { atomic_store(&uring_rings_len, len + 1); }
+        log_write(&log, "tracking io_uring %d (%u SQ entries).", fd, r->entries);
     }
-    manifest.header.num_chunks = 0;
-
-    // make a temporary buffer to determine whether or not ALL the connections
-    // specified in the comux header have at least one chunk assigned to them
-    uint8_t ccheck_buff[manifest.header.num_conns];
-    memset(ccheck_buff, 0, manifest.header.num_conns);
+    pthread_mutex_unlock(&uring_rings_lock);
+}
 
-    // next, we'll read each chunk header
-    comux_cinfo_t* chunks[num_chunks];
-    for (uint32_t i = 0; i < num_chunks; i++)
+// Scans the SQEs sitting between the kernel's head and the server's tail on a
+// raw ring that's about to be entered. Returns non-zero if one is an accept.
+static uint8_t PFX(uring_scan_raw)(int fd)
+{
+    uint32_t len = atomic_load(&uring_rings_len);
+    for (uint32_t i = 0; i < len; i++)
     {
-        // because these chunk structs will be passed to a new thread, we
-        // need them to be placed on the heap
-        chunks[i] = alloc_check(sizeof(comux_cinfo_t));
-        comux_cinfo_t* current = chunks[i];
-        comux_cinfo_init(current);
-        
-        // read the cinfo's header information
-        if ((res = comux_cinfo_read(current, STDIN_FILENO)))
-        {
-            fatality("failed to parse comux chunk %u: %s",
-                     i + 1, comux_parse_result_string(res));
-        }
+        const uring_ring_t* r = &uring_rings[i];
+        if (atomic_load(&r->fd) != fd)
+        { continue; }
 
-        // write a message out to the log describing what we found
-        ctl_log(&log, "%sfound chunk %u with fields: "
-                "conn_id=%u, datalen=%lu, sched=%u, flags=0x%x.",
-                i < num_chunks - 1 ? STAB_TREE2 : STAB_TREE1, i,
-                current->id, current->len, current->sched, current->flags);
-        
-        // make sure the connection ID is within the range specified by the
-        // header's 'num_conns'
-        if (current->id >= manifest.header.num_conns)
+        uint32_t head = atomic_load_explicit(r->khead, memory_order_acquire);
+        uint32_t tail = *r->ktail;
+        // never look at more than a full ring's worth, in case we raced
+        if (tail - head > r->entries)
+        { head = tail - r->entries; }
+        for (; head != tail; head++)
         {
-            fatality("Chunk %u has a connection ID (%u) outside the range of "
-                     "specified connections: [0, %u]",
-                     i, current->id, manifest.header.num_conns);
+            uint32_t idx = head & r->mask;
+            if (r->array)
+            { idx = r->array[idx] & r->mask; }
+            if (PFX(uring_sqe_is_accept)((const struct io_uring_sqe*)
+                                         (r->sqes + idx * r->sqe_size)))
+            { return 1; }
         }
-        ccheck_buff[current->id]++;
-
-        // add this cinfo struct to the manifest
-        comux_manifest_cinfo_add(&manifest, current);
-        
-        // for now, we won't read the data for each chunk. We'll seek past it
-        // to get to the next connection header
-        if (lseek(STDIN_FILENO, current->len, SEEK_CUR) == -1)
-        { fatality_errno(errno, "failed to seek past chunk %u's data segment", i + 1); }
+        return 0;
     }
+    return 0;
+}
+
+// Overloads the C library's syscall() wrapper, which is how servers using raw
+// io_uring reach io_uring_setup() and io_uring_enter(). Everything else passes
+// straight through. (We always forward six arguments, which is harmless for
+// system calls that take fewer.)
+long syscall(long number, ...)
+{
+    va_list args;
+    va_start(args, number);
+    long a[6];
+    for (int i = 0; i < 6; i++)
+    { a[i] = va_arg(args, long); }
+    va_end(args);
 
-    // pass through the buffer we made earlier to determine if there are any
-    // connections that don't have ANY chunks
-    for (uint32_t i = 0; i < manifest.header.num_conns; i++)
+    // before the controller is up, check each submission for an accept
+    if (number == __NR_io_uring_enter && !controller_spawned())
     {
-        if (ccheck_buff[i] == 0)
-        { fatality("connection ID %u is assigned zero chunks in this file.", i); }
+        lib_discover();
+        if (accept_sock != -1 && (unsigned) a[1] > 0 &&
+            PFX(uring_scan_raw)(a[0]))
+        { PFX(controller_spawn_once)("io_uring_enter"); }
     }
 
-    // set up a buffer to hold all the chunk threads' pthread IDs
-    pthread_t chunk_tids[manifest.header.num_chunks];
-    memset(chunk_tids, 0, manifest.header.num_chunks);
+    long ret = real_syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
 
-    // at this point we've parsed the comux header and all the chunk headers.
-    // Now, we need to start the process of spawning a thread for each
-    // connection. We'll do this in scheduling-value-order (that is, comux
-    // connections with LOWER 'sched' fields will go first).
-    uint32_t idx = 0;
-    while (manifest.cinfo_list.size > 0)
-    {
-        // by default, we'll select the first entry in the list
-        dllist_elem_t* e = dllist_get_head(&manifest.cinfo_list);
-        comux_cinfo_t* next = e->container;
-
-        // iterate through the list and find the lowest possible scheduling
-        // value. We'll remove and handle this one next
-        dllist_iterate(&manifest.cinfo_list, e)
-        {
-            comux_cinfo_t* cinfo = e->container;
-            // if this scheduling value is lower than our current scheduling
-            // value, update it
-            if (cinfo->sched < next->sched)
-            { next = cinfo; }
-        }
+    // remember any new rings, so we can peek at them when they're entered
+    if (number == __NR_io_uring_setup && ret >= 0 && !controller_spawned())
+    { PFX(uring_track)(ret, (const struct io_uring_params*) a[1]); }
+    return ret;
+}
 
-        // remove the selected entry from the list and decrement our
-        // connection-checking buffer (used above) so we know exactly how many
-        // chunks remain that deal with each connection. (By knowing this,
-        // we can tell the next chunk thread whether or not it's the LAST
-        // thread dealing with a specific connection)
-        dllist_remove(&manifest.cinfo_list, &next->elem);
-        uint8_t is_final_conn_chunk = --ccheck_buff[next->id] == 0;
-
-        // create a new parameter struct to pass to the chunk thread
-        chunk_thread_params_t* params = PFX(chunk_thread_params_make)(next,
-                                            idx, is_final_conn_chunk);
-
-        // at this point, we'll spawn a new "chunk thread" to handle this
-        // particular chunk
-        ctl_log(&log, "spawning chunk thread %u.%s%s%s", idx,
-                LOG_NOT_USING_FILE(&log) ? C_WARN : "",
-                wait_for_chunk_threads ? "" : " NO_WAIT mode enabled.",
-                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-        int err = pthread_create(&chunk_tids[idx], NULL, PFX(chunk_main), params);
-        if (err)
-        { fatality_errno(err, "failed to spawn chunk thread %u", idx); }
+// Looks up liburing's submission functions. Invoked once, the first time any
+// of our versions are called.
+static void PFX(uring_resolve)()
+{
+    real_io_uring_submit = dlsym(RTLD_NEXT, "io_uring_submit");
+    real_io_uring_submit_and_wait = dlsym(RTLD_NEXT, "io_uring_submit_and_wait");
+    real_io_uring_submit_and_wait_timeout =
+        dlsym(RTLD_NEXT, "io_uring_submit_and_wait_timeout");
+    real_io_uring_submit_and_get_events =
+        dlsym(RTLD_NEXT, "io_uring_submit_and_get_events");
+}
 
-        // join the thread (only if NO_WAIT mode is disabled)
-        if (wait_for_chunk_threads)
-        {
-            void* retval = NULL;
-            int join_err = pthread_join(chunk_tids[idx], &retval);
-            if (join_err)
-            { fatality_errno(join_err, "failed to join chunk thread %u", idx); }
-            ctl_log(&log, "joined chunk thread %u.", idx);
-        }
+// Makes sure liburing's functions have been looked up, and that the one we're
+// about to call was found. Exits on failure.
+#define uring_real(name) (*({                                       \
+        pthread_once(&uring_resolve_once, PFX(uring_resolve));      \
+        if (!real_##name)                                           \
+        { fatality("failed to look up '" #name "'"); }              \
+        &real_##name;                                               \
+    }))
 
-        idx++;
-    }
+// Scans the SQEs liburing is about to submit. That's anything flushed to the
+// kernel's ring but not yet consumed, plus anything handed out by
+// io_uring_get_sqe() but not yet flushed. If we find an accept on the
+// listener socket, the controller is spawned.
+static void PFX(uring_check)(struct io_uring* ring)
+{
+    if (controller_spawned() || !ring)
+    { return; }
+    lib_discover();
+    if (accept_sock == -1)
+    { return; }
+    const struct io_uring_sq* sq = &ring->sq;
+    uint32_t mask = *sq->kring_mask;
+    // 128-byte SQEs take up two slots of the 'sqes' array each
+    uint32_t shift = (ring->flags & IORING_SETUP_SQE128) ? 1 : 0;
+    uint32_t entries = *sq->kring_entries;
 
-    // if NO_WAIT mode is enabled, we'll spawn all the threads (done above),
-    // NOT wait for each one sequentially, then wait for all of them right here
-    if (!wait_for_chunk_threads)
+    // entries flushed to the kernel's SQ ring, but not consumed by it
+    uint32_t head = atomic_load_explicit((_Atomic uint32_t*) sq->khead,
+                                         memory_order_acquire);
+    uint32_t tail = *sq->ktail;
+    if (tail - head > entries)
+    { head = tail - entries; }
+    for (; head != tail; head++)
     {
-        ctl_log(&log, "%sNO_WAIT:%s all chunk threads spawned. Joining...",
-                LOG_NOT_USING_FILE(&log) ? C_WARN : "",
-                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-        // iterate through all chunk threads and join them
-        for (uint32_t i = 0; i < manifest.header.num_chunks; i++)
-        {
-            void* retval = NULL;
-            int join_err = pthread_join(chunk_tids[i], &retval);
-            if (join_err)
-            { fatality_errno(join_err, "failed to join chunk thread %u", i); }
-            ctl_log(&log, "%s%sNO_WAIT:%s joined chunk thread %u.",
-                    i < manifest.header.num_chunks - 1 ? STAB_TREE2 : STAB_TREE1,
-                    LOG_NOT_USING_FILE(&log) ? C_WARN : "",
-                    LOG_NOT_USING_FILE(&log) ? C_NONE : "",
-                    i);
-        }
+        uint32_t idx = head & mask;
+        if (sq->array)
+        { idx = sq->array[idx] & mask; }
+        if (PFX(uring_sqe_is_accept)(&sq->sqes[idx << shift]))
+        { goto found; }
     }
 
-    // free chunk memory
-    for (uint32_t i = 0; i < num_chunks; i++)
+    // entries prepared by the server, but not yet flushed
+    head = sq->sqe_head;
+    tail = sq->sqe_tail;
+    if (tail - head > entries)
+    { head = tail - entries; }
+    for (; head != tail; head++)
     {
-        comux_cinfo_free(chunks[i]);
+        if (PFX(uring_sqe_is_accept)(&sq->sqes[(head & mask) << shift]))
+        { goto found; }
     }
+    return;
 
-    // print an exit message and return
-    ctl_log(&log, "exiting.");
-    PFX(controller_exit)();
-    return NULL;
+found:
+    PFX(controller_spawn_once)("io_uring_submit");
 }
 
-// Spawns the main library thread (the "controller" thread). This thread is
-// responsible for reading comux-formatted input from stdin and spawning
-// threads for each chunk specified within the comux file.
-// If spawning the thread fails, the program exits.
-static void PFX(controller_spawn)()
+// Our versions of liburing's submission functions. Each one checks the batch
+// it's about to submit, then calls the real liburing function.
+int io_uring_submit(struct io_uring* ring)
 {
-    // attempt to spawn the thread
-    pthread_t tid;
-    int err = pthread_create(&tid, NULL, PFX(controller_main), NULL);
-    if (err)
-    { fatality_errno(err, "failed to spawn main library thread"); }
+    PFX(uring_check)(ring);
+    return uring_real(io_uring_submit)(ring);
+}
 
-    // detach the controller thread - nobody will be calling pthread_join() on
-    // it in the future, so we need the OS to clean its resources up itself
-    err = pthread_detach(tid);
-    if (err)
-    {
-        fatality_errno(err, "failed to detacth main library thread: %s",
-                       strerror(err));
-    }
+int io_uring_submit_and_wait(struct io_uring* ring, unsigned wait_nr)
+{
+    PFX(uring_check)(ring);
+    return uring_real(io_uring_submit_and_wait)(ring, wait_nr);
 }
 
+int io_uring_submit_and_wait_timeout(struct io_uring* ring, void** cqe_ptr,
+                                     unsigned wait_nr, void* ts, void* sigmask)
+{
+    PFX(uring_check)(ring);
+    return uring_real(io_uring_submit_and_wait_timeout)(ring, cqe_ptr, wait_nr,
+                                                        ts, sigmask);
+}
 
-// =============== Initialization and System Call Injection ================ //
-// Helper function used during the initialization process that attempts to
-// parse environment variables.
-static void PFX(init_environment_variables)()
+int io_uring_submit_and_get_events(struct io_uring* ring)
 {
-    // set up a small array of environment variables that take in unsigned ints
-    // and their respective global fields
-    char* unsigned_int_envvars[2] = {
-        GURTHANG_ENV_LIB_SEND_BUFFSIZE,
-        GURTHANG_ENV_LIB_RECV_BUFFSIZE
-    };
-    unsigned long* unsigned_int_envvars_fields[2] = {
-        &chunk_thread_write_buffsize,
-        &chunk_thread_read_buffsize
-    };
-    unsigned long unsigned_int_envvars_maximums[2] = {
-        chunk_thread_write_max_buffsize,
-        chunk_thread_read_max_buffsize
-    };
+    PFX(uring_check)(ring);
+    return uring_real(io_uring_submit_and_get_events)(ring);
+}
 
-    for (int i = 0; i < sizeof(unsigned_int_envvars) / sizeof(char*); i++)
-    {
-        char* env_name = unsigned_int_envvars[i];
-        unsigned long* env_field = unsigned_int_envvars_fields[i];
-        unsigned long env_maximum = unsigned_int_envvars_maximums[i];
 
-        // attempt to retrieve the environment variable's value
-        char* env = getenv(env_name);
-        if (!env)
-        { continue; }
+// =========================== TLS Interposition =========================== //
+// With GURTHANG_LIB_TLS_BYPASS set, we interpose a handful of OpenSSL's SSL_*
+// functions. For server-side SSL objects sitting on a comux connection, the
+// handshake reports instant success and reads/writes go straight through the
+// SSL object's BIOs, so the server sees our plaintext. A connection is a comux
+// connection if its local address is the listener socket's, which holds no
+// matter how it was accepted (accept(), accept4(), or io_uring). To find the
+// connection, we need a socket BIO somewhere in the SSL object's read chain.
+// Servers that only give OpenSSL BIOs of their own (such as Apache's mod_ssl,
+// whose BIOs talk to its filter chain) hide the socket from us, so they keep
+// real TLS.
+//
+// We don't include (or link against) OpenSSL. The types are opaque and the
+// handful of constants we need are copied from ssl.h and bio.h. The real
+// functions are looked up lazily, since libssl is often dlopen()'d long after
+// this library is loaded (as part of a server module, for example).
+typedef struct ssl_st SSL;
+typedef struct bio_st BIO;
+#define GURTHANG_SSL_ERROR_NONE 0
+#define GURTHANG_SSL_ERROR_WANT_READ 2
+#define GURTHANG_SSL_ERROR_WANT_WRITE 3
+#define GURTHANG_SSL_ERROR_SYSCALL 5
+#define GURTHANG_SSL_ERROR_ZERO_RETURN 6
+#define GURTHANG_BIO_FLAGS_READ 0x01
+#define GURTHANG_BIO_FLAGS_WRITE 0x02
+#define GURTHANG_BIO_FLAGS_SHOULD_RETRY 0x08
+#define GURTHANG_BIO_CTRL_FLUSH 11
 
-        // write a message stating we found it
-        log_write(&log, "found %s%s=%s%s.",
-                LOG_NOT_USING_FILE(&log) ? C_DATA : "",
-                env_name, env,
-                LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-        
-        // attempt to convert the integer
-        long conversion = 0;
-        if (str_to_int(env, &conversion) || conversion <= 0)
-        {
-            fatality("%s%s%s must be set to a positive integer.",
-                    LOG_NOT_USING_FILE(&log) ? C_DATA : "",
-                    env_name,
-                    LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-        }
+// Real OpenSSL functions
+static int (*real_SSL_accept) (SSL*);
+static int (*real_SSL_do_handshake) (SSL*);
+static int (*real_SSL_read) (SSL*, void*, int);
+static int (*real_SSL_read_ex) (SSL*, void*, size_t, size_t*);
+static int (*real_SSL_write) (SSL*, const void*, int);
+static int (*real_SSL_write_ex) (SSL*, const void*, size_t, size_t*);
+static int (*real_SSL_pending) (const SSL*);
+static int (*real_SSL_has_pending) (const SSL*);
+static int (*real_SSL_shutdown) (SSL*);
+static int (*real_SSL_get_error) (const SSL*, int);
+static int (*real_SSL_is_init_finished) (const SSL*);
+static int (*real_SSL_in_init) (const SSL*);
+static int (*real_SSL_get_fd) (const SSL*);
+static int (*real_SSL_is_server) (const SSL*);
+static BIO* (*real_SSL_get_rbio) (const SSL*);
+static BIO* (*real_SSL_get_wbio) (const SSL*);
+static int (*real_BIO_read) (BIO*, void*, int);
+static int (*real_BIO_write) (BIO*, const void*, int);
+static long (*real_BIO_ctrl) (BIO*, int, long, void*);
+static int (*real_BIO_test_flags) (const BIO*, int);
+static pthread_once_t tls_resolve_once = PTHREAD_ONCE_INIT;
 
-        // there's a cap, enforce it if necessary
-        if (env_maximum > 0 && conversion > env_maximum)
-        {
-            conversion = env_maximum;
-            log_write(&log, STAB_TREE1 "exceeded maximum value - capped off at %lu.",
-                      env_maximum);
-        }
+// The result of the last bypassed SSL call made by each thread, so our
+// SSL_get_error() can report it.
+static __thread const SSL* tls_last_ssl = NULL;
+static __thread int tls_last_error = GURTHANG_SSL_ERROR_NONE;
 
-        // save the integer
-        *env_field = conversion;
-    }
+// Looks up a single OpenSSL function. We try the usual RTLD_NEXT route first,
+// then fall back to asking an already-loaded libssl/libcrypto directly (in
+// case it was loaded with RTLD_LOCAL).
+static void* PFX(tls_resolve_symbol)(const char* name)
+{
+    void* sym = dlsym(RTLD_NEXT, name);
+    if (sym)
+    { return sym; }
 
-    // look for the 'NO_WAIT' environment variable. If this is defined, we'll
-    // flip a global switch that forces the controller thread to NOT wait for
-    // chunk threads as they're spawned. Instead, the controller thread will
-    // spawn all N chunk threads, *then* wait for all N of them to exit.
-    if (getenv(GURTHANG_ENV_LIB_NO_WAIT))
+    const char* libs[] = {
+        "libssl.so.3", "libssl.so.1.1", "libssl.so",
+        "libcrypto.so.3", "libcrypto.so.1.1", "libcrypto.so"
+    };
+    for (int i = 0; i < sizeof(libs) / sizeof(char*) && !sym; i++)
     {
-        log_write(&log, "found %s%s%s. Enabling %sNO_WAIT%s mode.",
-                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
-                  GURTHANG_ENV_LIB_NO_WAIT,
-                  LOG_NOT_USING_FILE(&log) ? C_NONE : "",
-                  LOG_NOT_USING_FILE(&log) ? C_WARN : "",
-                  LOG_NOT_USING_FILE(&log) ? C_NONE : "");
-        wait_for_chunk_threads = 0;
+        void* handle = dlopen(libs[i], RTLD_LAZY | RTLD_NOLOAD);
+        if (handle)
+        {
+            sym = dlsym(handle, name);
+            dlclose(handle);
+        }
     }
+    return sym;
+}
 
-    // look for the 'EXIT_IMMEDIATE' environment variable. If this is set, the
-    // controller thread will invoke _exit() rather than exit(), to avoid the
-    // controller thread running any registered exit handlers, which may cause
-    // issues.
-    if (getenv(GURTHANG_ENV_LIB_EXIT_IMMEDIATE))
+// Looks up all the OpenSSL functions we might need. Invoked once, the first
+// time any of our SSL_* functions are called.
+static void PFX(tls_resolve)()
+{
+    real_SSL_accept = PFX(tls_resolve_symbol)("SSL_accept");
+    real_SSL_do_handshake = PFX(tls_resolve_symbol)("SSL_do_handshake");
+    real_SSL_read = PFX(tls_resolve_symbol)("SSL_read");
+    real_SSL_read_ex = PFX(tls_resolve_symbol)("SSL_read_ex");
+    real_SSL_write = PFX(tls_resolve_symbol)("SSL_write");
+    real_SSL_write_ex = PFX(tls_resolve_symbol)("SSL_write_ex");
+    real_SSL_pending = PFX(tls_resolve_symbol)("SSL_pending");
+    real_SSL_has_pending = PFX(tls_resolve_symbol)("SSL_has_pending");
+    real_SSL_shutdown = PFX(tls_resolve_symbol)("SSL_shutdown");
+    real_SSL_get_error = PFX(tls_resolve_symbol)("SSL_get_error");
+    real_SSL_is_init_finished = PFX(tls_resolve_symbol)("SSL_is_init_finished");
+    real_SSL_in_init = PFX(tls_resolve_symbol)("SSL_in_init");
+    real_SSL_get_fd = PFX(tls_resolve_symbol)("SSL_get_fd");
+    real_SSL_is_server = PFX(tls_resolve_symbol)("SSL_is_server");
+    real_SSL_get_rbio = PFX(tls_resolve_symbol)("SSL_get_rbio");
+    real_SSL_get_wbio = PFX(tls_resolve_symbol)("SSL_get_wbio");
+    real_BIO_read = PFX(tls_resolve_symbol)("BIO_read");
+    real_BIO_write = PFX(tls_resolve_symbol)("BIO_write");
+    real_BIO_ctrl = PFX(tls_resolve_symbol)("BIO_ctrl");
+    real_BIO_test_flags = PFX(tls_resolve_symbol)("BIO_test_flags");
+}
+
+// Makes sure the real OpenSSL functions have been looked up, and that the one
+// we're about to call was found. Exits on failure.
+#define tls_real(name) (*({                                         \
+        pthread_once(&tls_resolve_once, PFX(tls_resolve));          \
+        if (!real_##name)                                           \
+        { fatality("failed to look up '" #name "'"); }              \
+        &real_##name;                                               \
+    }))
+
+// Returns non-zero if the given socket was accepted on the listener socket:
+// that is, its local address is the listener's.
+static uint8_t PFX(tls_on_listener)(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (fd < 0 || fd == accept_sock ||
+        getsockname(fd, (struct sockaddr*) &addr, &addr_len) == -1 ||
+        addr.ss_family != tls_listen_addr.ss_family)
+    { return 0; }
+
+    // listeners bound to a wildcard address hand out connections with all
+    // sorts of local addresses, so for TCP only the port has to match
+    switch (addr.ss_family)
     {
-        log_write(&log, "found %s%s%s. The controller thread will invoke "
-                  "_exit(), rather than exit().",
-                  LOG_NOT_USING_FILE(&log) ? C_DATA : "",
-                  GURTHANG_ENV_LIB_EXIT_IMMEDIATE,
-                  LOG_NOT_USING_FILE(&log) ? C_NONE: "");
-        exit_immediate = 1;
-        fatality_set_exit_method(1); // make sure we _exit() on fatal errors
+        case AF_INET:
+            return ((struct sockaddr_in*) &addr)->sin_port ==
+                   ((struct sockaddr_in*) &tls_listen_addr)->sin_port;
+        case AF_INET6:
+            return ((struct sockaddr_in6*) &addr)->sin6_port ==
+                   ((struct sockaddr_in6*) &tls_listen_addr)->sin6_port;
+        default:
+            return addr_len == tls_listen_addr_len &&
+                   !memcmp(&addr, &tls_listen_addr, addr_len);
     }
 }
 
-// The initialization function for the library. Called a single time by the
-// first thread that calls accept(). Takes in the socket file descriptor the
-// target server is accepting connections on.
-static void PFX(init)(int sockfd)
+// Returns non-zero if the given SSL object should have its TLS bypassed. That
+// is: bypass mode is on, the SSL object is acting as a server, and it's
+// sitting on one of our comux connections. SSL_get_fd() walks the read BIO
+// chain for a socket BIO, so filter BIOs stacked on top of one are seen
+// through. (SSL objects without a socket anywhere, such as ones on memory
+// BIOs, can't be told apart from ones that aren't ours, so they're left alone.)
+static uint8_t PFX(tls_is_bypassed)(const SSL* ssl)
 {
-    log_init(&log, "gurthang-lib", GURTHANG_ENV_LIB_LOG);
+    if (!tls_bypass || !ssl)
+    { return 0; }
+    pthread_once(&tls_resolve_once, PFX(tls_resolve));
+    if (real_SSL_is_server && !real_SSL_is_server(ssl))
+    { return 0; }
+    if (!real_SSL_get_rbio || !real_SSL_get_wbio ||
+        !real_BIO_read || !real_BIO_write)
+    { return 0; }
 
-    // check other environment variables
-    PFX(init_environment_variables)();
+    int fd = real_SSL_get_fd ? real_SSL_get_fd(ssl) : -1;
+    return PFX(tls_on_listener)(fd);
+}
 
-    // save the socket file descriptor
-    accept_sock = sockfd;
+// Records the result of a bypassed call for SSL_get_error() and returns the
+// given return value.
+static int PFX(tls_result)(const SSL* ssl, int error, int retval)
+{
+    tls_last_ssl = ssl;
+    tls_last_error = error;
+    return retval;
+}
 
-    // look up the real accept() system call, so we can invoke it at the end of
-    // our own injected version of accept(). Exit on failure
-    real_accept = dlsym(RTLD_NEXT, "accept");
-    if (!real_accept)
-    { fatality("failed to look up 'accept' system call"); }
-    else
-    { log_write(&log, "found accept system call: %p", real_accept); }
-    
-    // look up the real accept4() system call in the same manner
-    real_accept4 = dlsym(RTLD_NEXT, "accept4");
-    if (!real_accept)
-    { fatality("failed to look up 'accept4' system call"); }
-    else
-    { log_write(&log, "found accept4 system call: %p", real_accept4); }
+// Translates the result of a BIO_read()/BIO_write() into an SSL error code.
+static int PFX(tls_bio_error)(BIO* bio, int ret)
+{
+    if (ret > 0)
+    { return GURTHANG_SSL_ERROR_NONE; }
+    if (real_BIO_test_flags &&
+        real_BIO_test_flags(bio, GURTHANG_BIO_FLAGS_SHOULD_RETRY))
+    {
+        return real_BIO_test_flags(bio, GURTHANG_BIO_FLAGS_WRITE) ?
+               GURTHANG_SSL_ERROR_WANT_WRITE : GURTHANG_SSL_ERROR_WANT_READ;
+    }
+    return ret == 0 ? GURTHANG_SSL_ERROR_ZERO_RETURN : GURTHANG_SSL_ERROR_SYSCALL;
+}
 
-    // look up the real listen() system call in the same manner
-    real_listen = dlsym(RTLD_NEXT, "listen");
-    if (!real_listen)
-    { fatality("failed to look up 'listen' system call"); }
-    else
-    { log_write(&log, "found listen system call: %p", real_listen); }
-    
-    // look up the real epoll_ctl()
-    real_epoll_ctl = dlsym(RTLD_NEXT, "epoll_ctl");
-    if (!real_epoll_ctl)
-    { fatality("failed to look up 'epoll_ctl' system call"); }
-    else
-    { log_write(&log, "found epoll_ctl system call: %p", real_epoll_ctl); }
-    
-    // look up the real epoll_wait()
-    real_epoll_wait = dlsym(RTLD_NEXT, "epoll_wait");
-    if (!real_epoll_wait)
-    { fatality("failed to look up 'epoll_wait' system call"); }
-    else
-    { log_write(&log, "found epoll_wait system call: %p", real_epoll_wait); }
+// Reads plaintext for a bypassed SSL object. Returns what BIO_read() returned.
+static int PFX(tls_bypass_read)(SSL* ssl, void* buff, int num)
+{
+    BIO* rbio = real_SSL_get_rbio(ssl);
+    if (!rbio)
+    { return PFX(tls_result)(ssl, GURTHANG_SSL_ERROR_SYSCALL, -1); }
+    int ret = real_BIO_read(rbio, buff, num);
+    return PFX(tls_result)(ssl, PFX(tls_bio_error)(rbio, ret), ret);
+}
 
-    // initialize the connection table (we don't have any live connections yet)
-    for (uint32_t i = 0; i < CTABLE_MAXLEN; i++)
-    { ctable[i].status = CONN_STATUS_DEAD; }
-    pthread_mutex_init(&ctable_lock, NULL);
+// Writes plaintext for a bypassed SSL object, then flushes the BIO (just like
+// OpenSSL does after writing a record). Returns what BIO_write() returned.
+static int PFX(tls_bypass_write)(SSL* ssl, const void* buff, int num)
+{
+    BIO* wbio = real_SSL_get_wbio(ssl);
+    if (!wbio)
+    { return PFX(tls_result)(ssl, GURTHANG_SSL_ERROR_SYSCALL, -1); }
+    int ret = real_BIO_write(wbio, buff, num);
+    if (ret > 0 && real_BIO_ctrl)
+    { real_BIO_ctrl(wbio, GURTHANG_BIO_CTRL_FLUSH, 0, NULL); }
+    return PFX(tls_result)(ssl, PFX(tls_bio_error)(wbio, ret), ret);
 }
 
-// ========================= System Call Injection ========================= //
-// This overloads the listen() system call. We use this simply to capture the
-// server's listener socket for later use.
-int listen(int sockfd, int backlog)
+// For a bypassed connection the handshake is over before it starts.
+int SSL_accept(SSL* ssl)
 {
-    pthread_mutex_lock(&alock);
-    // we'll use 'listen_count' to ensure we don't initialize multiple times
-    static uint8_t listen_count = 0;
-    if (!listen_count)
-    {
-        PFX(init)(sockfd);
-        listen_count++;
-    }
-    pthread_mutex_unlock(&alock);
+    if (PFX(tls_is_bypassed)(ssl))
+    { return PFX(tls_result)(ssl, GURTHANG_SSL_ERROR_NONE, 1); }
+    return tls_real(SSL_accept)(ssl);
+}
 
-    // invoke the REAL listen() system call
-    return real_listen(sockfd, backlog);
+int SSL_do_handshake(SSL* ssl)
+{
+    if (PFX(tls_is_bypassed)(ssl))
+    { return PFX(tls_result)(ssl, GURTHANG_SSL_ERROR_NONE, 1); }
+    return tls_real(SSL_do_handshake)(ssl);
 }
 
-// Overloads epoll_ctl() system call. We overload this in order to detect and
-// save the file descriptor used with the server's listener socket file
-// descriptor (if the server does this).
-int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event)
+int SSL_is_init_finished(const SSL* ssl)
 {
-    // only perform extra actions if we haven't already set the epoll FD
-    if (epoll_fd == -1)
-    {
-        pthread_mutex_lock(&alock);
-        // if the accept socket hasn't been saved yet (via our injected
-        // listen() system call), log this (this might happen if an unrelated
-        // epoll set is created before listen() is invoked)
-        if (accept_sock == -1)
-        {
-            log_write(&log, C_WARN "epoll_ctl() invoked before the listener "
-                      "socket was discovered." C_NONE);
-        }
-        // otherwise, check to see if this epoll set is having the listener
-        // socket added to it. If that's the case, we're interested
-        else if (op == EPOLL_CTL_ADD && accept_sock == fd)
-        {
-            epoll_fd = epfd;
-            log_write(&log, "found listener socket epoll FD: %d", epfd);
-        }
-        pthread_mutex_unlock(&alock);
-    }
+    if (PFX(tls_is_bypassed)(ssl))
+    { return 1; }
+    return tls_real(SSL_is_init_finished)(ssl);
+}
 
-    // call the original epoll_ctl()
-    return real_epoll_ctl(epfd, op, fd, event);
+int SSL_in_init(const SSL* ssl)
+{
+    if (PFX(tls_is_bypassed)(ssl))
+    { return 0; }
+    return tls_real(SSL_in_init)(ssl);
 }
 
-// Overloads epoll_wait() system call. We overload this in the event the server
-// has an epoll file descriptor used to monitor the listener socket. A thread
-// for such a server might call epoll_wait() before it calls accept(). If this
-// library simply blocked on accept(), it would never know the threads are
-// stuck in epoll_wait() waiting for a connection to be made.
-int epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout)
+int SSL_read(SSL* ssl, void* buff, int num)
 {
-    pthread_mutex_lock(&alock);
+    if (PFX(tls_is_bypassed)(ssl))
+    { return PFX(tls_bypass_read)(ssl, buff, num); }
+    return tls_real(SSL_read)(ssl, buff, num);
+}
 
-    // if we saved an epoll file descriptor in an earlier call to epoll_ctl(),
-    // we'll proceed so long as this call to epoll_wait() is using that FD.
-    // Also, we'll only run the below code if the controller thread also hasn't
-    // been initialized yet.
-    uint8_t waiting_on_listener_epfd = epoll_fd > -1 && epoll_fd == epfd;
-    if (waiting_on_listener_epfd && !controller_initialized)
+int SSL_read_ex(SSL* ssl, void* buff, size_t num, size_t* readbytes)
+{
+    if (PFX(tls_is_bypassed)(ssl))
     {
-        log_write(&log, "spawning controller thread (via epoll_wait).");
-        PFX(controller_spawn)();        // spawn the controller thread
-        controller_initialized++;       // make sure this doesn't happen again
+        int ret = PFX(tls_bypass_read)(ssl, buff, MIN(num, INT32_MAX));
+        *readbytes = ret > 0 ? ret : 0;
+        return ret > 0;
     }
-
-    // invoke and return the real epoll_wait()
-    pthread_mutex_unlock(&alock);
-    return real_epoll_wait(epfd, events, maxevents, timeout);
+    return tls_real(SSL_read_ex)(ssl, buff, num, readbytes);
 }
 
-// The definition for our own version of the accept() system call. The target
-// server's thread will call this, run some extra library code, then make a
-// call to the REAL accept() and return its value.
-int accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen)
+int SSL_write(SSL* ssl, const void* buff, int num)
 {
-    pthread_mutex_lock(&alock);
+    if (PFX(tls_is_bypassed)(ssl))
+    { return PFX(tls_bypass_write)(ssl, buff, num); }
+    return tls_real(SSL_write)(ssl, buff, num);
+}
 
-    // initialize the library, if we haven't done so already
-    if (!controller_initialized)
+int SSL_write_ex(SSL* ssl, const void* buff, size_t num, size_t* written)
+{
+    if (PFX(tls_is_bypassed)(ssl))
     {
-        log_write(&log, "spawning controller thread (via accept).");
-        PFX(controller_spawn)();        // spawn the controller thread
-        controller_initialized++;       // make sure this doesn't happen again
+        int ret = PFX(tls_bypass_write)(ssl, buff, MIN(num, INT32_MAX));
+        *written = ret > 0 ? ret : 0;
+        return ret > 0;
     }
+    return tls_real(SSL_write_ex)(ssl, buff, num, written);
+}
 
-    // finally, release the lock and invoke the REAL system call
-    pthread_mutex_unlock(&alock);
-    return real_accept(sockfd, addr, addrlen);
+// Bypassed connections never have decrypted bytes waiting in OpenSSL.
+int SSL_pending(const SSL* ssl)
+{
+    if (PFX(tls_is_bypassed)(ssl))
+    { return 0; }
+    return tls_real(SSL_pending)(ssl);
 }
 
-// Definition of our own version of accept4(). Behaves exactly the same as our
-// version of accept(). Initializes the controller thread if applicable, then
-// makes a call to the REAL accept4().
-int accept4(int sockfd, struct sockaddr* addr, socklen_t* addrlen, int flags)
+int SSL_has_pending(const SSL* ssl)
 {
-    pthread_mutex_lock(&alock);
+    if (PFX(tls_is_bypassed)(ssl))
+    { return 0; }
+    return tls_real(SSL_has_pending)(ssl);
+}
 
-    // initialize the library if it has yet to be done
-    if (!controller_initialized)
-    {
-        log_write(&log, "spawning controller thread (via accept4).");
-        PFX(controller_spawn)();        // spawn controller thread
-        controller_initialized++;       // make sure it doesn't happen again
-    }
+// There's no close_notify to send on a bypassed connection, so shutdown
+// completes right away. The server will close the socket itself.
+int SSL_shutdown(SSL* ssl)
+{
+    if (PFX(tls_is_bypassed)(ssl))
+    { return PFX(tls_result)(ssl, GURTHANG_SSL_ERROR_NONE, 1); }
+    return tls_real(SSL_shutdown)(ssl);
+}
 
-    // unlock and invoke the real accept4()
-    pthread_mutex_unlock(&alock);
-    return real_accept4(sockfd, addr, addrlen, flags);
+int SSL_get_error(const SSL* ssl, int ret)
+{
+    if (tls_bypass && ssl && ssl == tls_last_ssl && PFX(tls_is_bypassed)(ssl))
+    { return ret > 0 ? GURTHANG_SSL_ERROR_NONE : tls_last_error; }
+    return tls_real(SSL_get_error)(ssl, ret);
 }
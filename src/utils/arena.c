@@ -0,0 +1,88 @@
+// Implements the functions from arena.h.
+//
+//      Connor Shugg
+
+#include "arena.h"
+#include "utils.h"
+
+// ======================= Helper Functions & Macros ======================= //
+// Rounds the given size up to the next multiple of ARENA_ALIGN.
+#define ARENA_ROUND_UP(bytes) (((bytes) + (ARENA_ALIGN - 1)) & ~((size_t) ARENA_ALIGN - 1))
+
+// Allocates a new, empty block with the given capacity and chains it onto the
+// front of the arena.
+static void arena_block_push(arena_t* arena, size_t capacity)
+{
+    arena_block_t* block = alloc_check(sizeof(arena_block_t) + capacity);
+    block->next = arena->head;
+    block->cap = capacity;
+    block->used = 0;
+    arena->head = block;
+}
+
+// Frees every block in the arena.
+static void arena_blocks_free(arena_t* arena)
+{
+    arena_block_t* block = arena->head;
+    while (block)
+    {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+
+// ========================== Main Functionality =========================== //
+void arena_init(arena_t* arena, size_t capacity)
+{
+    arena->head = NULL;
+    arena->total = 0;
+    if (capacity > 0)
+    { arena_block_push(arena, ARENA_ROUND_UP(capacity)); }
+}
+
+void arena_free(arena_t* arena)
+{
+    arena_blocks_free(arena);
+    arena->total = 0;
+}
+
+void* arena_alloc(arena_t* arena, size_t bytes)
+{
+    bytes = ARENA_ROUND_UP(bytes);
+
+    // if the current block doesn't have room, chain on a new one that's at
+    // least twice as big (and big enough for this allocation)
+    arena_block_t* block = arena->head;
+    if (!block || block->cap - block->used < bytes)
+    {
+        size_t capacity = block ? block->cap * 2 : ARENA_ALIGN;
+        arena_block_push(arena, MAX(capacity, bytes));
+        block = arena->head;
+    }
+
+    // the block's memory starts right after the (aligned) block header, so
+    // bumping by multiples of ARENA_ALIGN keeps every allocation aligned
+    void* ptr = block->data + block->used;
+    block->used += bytes;
+    arena->total += bytes;
+    return ptr;
+}
+
+void arena_reset(arena_t* arena)
+{
+    // if we had to chain on more blocks since the last reset, replace them
+    // all with a single one that can fit everything at once
+    if (arena->head && arena->head->next)
+    {
+        size_t capacity = MAX(arena->total, arena->head->cap);
+        arena_blocks_free(arena);
+        arena_block_push(arena, capacity);
+    }
+
+    if (arena->head)
+    { arena->head->used = 0; }
+    arena->total = 0;
+}
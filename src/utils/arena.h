@@ -0,0 +1,56 @@
+// This header file defines a simple arena (or "bump") allocator. Memory is
+// handed out from large blocks by moving a pointer forward, and it's all given
+// back at once by resetting the arena. It's meant for code that makes lots of
+// short-lived allocations and frees them together, such as the mutator's
+// per-test-case bookkeeping.
+//
+// Pointers handed out by the arena stay valid until the next reset. If a
+// block fills up, a new one is chained onto it. On the next reset, the chain
+// is replaced with a single block big enough to hold everything that was
+// allocated, so an arena that sees the same workload over and over settles
+// into never calling malloc() at all.
+//
+//      Connor Shugg
+
+#if !defined(ARENA_H)
+#define ARENA_H
+
+// Module inclusions
+#include <stdlib.h>
+
+// Every allocation is aligned to this many bytes.
+#define ARENA_ALIGN 16
+
+// A single block of arena memory. Blocks are chained together, newest first.
+typedef struct arena_block
+{
+    struct arena_block* next;   // the block that filled up before this one
+    size_t cap;                 // number of bytes in 'data'
+    size_t used;                // number of bytes handed out from 'data'
+    _Alignas(ARENA_ALIGN) char data[]; // the memory itself
+} arena_block_t;
+
+// The main arena struct.
+typedef struct arena
+{
+    arena_block_t* head;        // the block allocations are coming from
+    size_t total;               // bytes handed out since the last reset
+} arena_t;
+
+// Initializes the arena with a single block of the given capacity. (A
+// capacity of zero defers allocating any memory until it's needed.)
+void arena_init(arena_t* arena, size_t capacity);
+
+// Frees all of the arena's memory.
+void arena_free(arena_t* arena);
+
+// Allocates the given number of bytes from the arena and returns a pointer to
+// them. The memory isn't zeroed. This never returns NULL (failing to allocate
+// a new block is fatal).
+void* arena_alloc(arena_t* arena, size_t bytes);
+
+// Gives back everything allocated from the arena, so its memory can be handed
+// out again. Any pointers returned by arena_alloc() are no longer valid.
+void arena_reset(arena_t* arena);
+
+#endif
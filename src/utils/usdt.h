@@ -0,0 +1,46 @@
+// This header file defines a small set of macros used to place USDT
+// (user-level statically-defined tracing) probes throughout gurthang. When
+// <sys/sdt.h> is available (it ships with systemtap's development package),
+// each probe compiles down to a single 'nop' instruction plus a note in the
+// ELF's .note.stapsdt section, which tools like bpftrace, perf and systemtap
+// can attach to at runtime. When nothing is attached, the nop is all that
+// runs. If <sys/sdt.h> isn't around (or GURTHANG_NO_USDT is defined), the
+// macros expand to nothing at all.
+//
+// All probes live under the "gurthang" provider. For example:
+//      bpftrace -e 'usdt:./gurthang-preload.so:gurthang:send_end { ... }'
+//
+//      Connor Shugg
+
+#if !defined(USDT_H)
+#define USDT_H
+
+#if !defined(GURTHANG_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define GURTHANG_USDT_ENABLED
+#endif
+#endif
+
+#if defined(GURTHANG_USDT_ENABLED)
+// Probe macros: one per argument count, to mirror sdt.h's own interface.
+#define GURTHANG_PROBE0(name) \
+    DTRACE_PROBE(gurthang, name)
+#define GURTHANG_PROBE1(name, a1) \
+    DTRACE_PROBE1(gurthang, name, a1)
+#define GURTHANG_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(gurthang, name, a1, a2)
+#define GURTHANG_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(gurthang, name, a1, a2, a3)
+#else
+// No-op versions. The arguments are cast to void (but never evaluated beyond
+// that) so variables that exist only to feed a probe don't trip -Wall.
+#define GURTHANG_PROBE0(name) do {} while (0)
+#define GURTHANG_PROBE1(name, a1) do { (void) (a1); } while (0)
+#define GURTHANG_PROBE2(name, a1, a2) \
+    do { (void) (a1); (void) (a2); } while (0)
+#define GURTHANG_PROBE3(name, a1, a2, a3) \
+    do { (void) (a1); (void) (a2); (void) (a3); } while (0)
+#endif
+
+#endif
@@ -0,0 +1,68 @@
+// Tests my arena allocator, defined in utils/arena.h and implemented in
+// utils/arena.c.
+//
+//      Connor Shugg
+
+#include <string.h>
+#include <stdint.h>
+#include "test.h"
+#include "../src/utils/arena.h"
+
+int main()
+{
+    test_section("arena init");
+    arena_t arena;
+    arena_init(&arena, 0);
+    check(arena.head == NULL, "arena with no capacity allocated a block");
+    check(arena.total == 0, "arena total isn't 0");
+    arena_free(&arena);
+    arena_init(&arena, 100);
+    check(arena.head != NULL, "arena didn't allocate its first block");
+    check(arena.head->cap == 112, "arena block cap isn't rounded up to 112");
+    check(arena.head->used == 0, "arena block used isn't 0");
+    check(arena.head->next == NULL, "arena has more than one block");
+
+    test_section("arena alloc");
+    char* p1 = arena_alloc(&arena, 10);
+    char* p2 = arena_alloc(&arena, 20);
+    check(((uintptr_t) p1) % ARENA_ALIGN == 0, "first allocation isn't aligned");
+    check(((uintptr_t) p2) % ARENA_ALIGN == 0, "second allocation isn't aligned");
+    check(p2 - p1 == 16, "second allocation isn't right after the first");
+    check(arena.head->used == 48, "arena block used isn't 48");
+    check(arena.total == 48, "arena total isn't 48");
+    memset(p1, 'a', 10);
+    memset(p2, 'b', 20);
+
+    // this won't fit in the first block, so a new one is chained on. The old
+    // allocations must stay put
+    char* p3 = arena_alloc(&arena, 200);
+    check(arena.head->next != NULL, "arena didn't chain on a new block");
+    check(arena.head->cap == 224, "new block cap isn't 224");
+    check(((uintptr_t) p3) % ARENA_ALIGN == 0, "third allocation isn't aligned");
+    check(arena.total == 256, "arena total isn't 256");
+    memset(p3, 'c', 200);
+    check(p1[0] == 'a' && p1[9] == 'a', "first allocation was clobbered");
+    check(p2[0] == 'b' && p2[19] == 'b', "second allocation was clobbered");
+
+    test_section("arena reset");
+    arena_reset(&arena);
+    check(arena.head != NULL, "arena lost its memory on reset");
+    check(arena.head->next == NULL, "arena didn't coalesce its blocks");
+    check(arena.head->cap >= 256, "coalesced block can't fit the last workload");
+    check(arena.head->used == 0, "arena block used isn't 0 after reset");
+    check(arena.total == 0, "arena total isn't 0 after reset");
+
+    // the same workload should now fit in the one block
+    arena_block_t* block = arena.head;
+    arena_alloc(&arena, 10);
+    arena_alloc(&arena, 20);
+    arena_alloc(&arena, 200);
+    check(arena.head == block, "arena chained on a block for the same workload");
+    arena_reset(&arena);
+    check(arena.head == block, "arena replaced a block it didn't need to");
+
+    arena_free(&arena);
+    check(arena.head == NULL, "arena head isn't NULL after free");
+
+    test_finish();
+}
@@ -325,11 +325,118 @@ static void test_cinfo_data_io()
     check(c2.flags == 0xabcd, "c2's flags are wrong");
     check(c2.len == 15000, "c2's len is wrong");
     check(!memcmp(buffer_dptr(&c2.data), buff, buff_size), "buffer bytes don't match");
+    comux_cinfo_free(&c2);
+
+    test_section("cinfo data pread");
+    comux_cinfo_init(&c2);
+    fd = open("./comux_test4.txt", O_RDONLY);
+    check(fd != -1, "failed to open a file descriptor");
+    check(comux_cinfo_read(&c2, fd) == COMUX_PARSE_OK, "comux_cinfo_read failed");
+    // move the file offset somewhere else; pread should ignore it
+    check(lseek(fd, 0, SEEK_END) != -1, "failed to seek to the end of the file");
+    rcount = comux_cinfo_data_pread(&c2, fd);
+    check(rcount == 15000, "comux_cinfo_data_pread returned %ld, not 15000", rcount);
+    check(lseek(fd, 0, SEEK_CUR) == 15020, "comux_cinfo_data_pread moved the file offset");
+    close(fd);
+    check(c2.len == 15000, "c2's len is wrong");
+    check(c2.data.size == 15000, "c2's buffer size is wrong");
+    check(!memcmp(buffer_dptr(&c2.data), buff, buff_size), "buffer bytes don't match");
     
     comux_cinfo_free(&c2);
     comux_cinfo_free(&c);
 }
 
+// Tests the segmentation bits in a cinfo's flags
+static void test_cinfo_segment()
+{
+    test_section("cinfo segmentation");
+    comux_cinfo_t c;
+    comux_cinfo_init(&c);
+    check(comux_cinfo_segment_size(&c) == 0, "a new cinfo is segmented");
+    check(comux_cinfo_segment_gap(&c) == 0, "a new cinfo has a segment gap");
+
+    // set the segmentation and make sure the real flags are untouched
+    c.flags = COMUX_CHUNK_FLAGS_AWAIT_RESPONSE;
+    comux_cinfo_segment_set(&c, 1, 100);
+    check(comux_cinfo_segment_size(&c) == 1, "segment size is %lu, not 1",
+          comux_cinfo_segment_size(&c));
+    check(comux_cinfo_segment_gap(&c) == 64, "segment gap is %u, not 64",
+          comux_cinfo_segment_gap(&c));
+    check(c.flags == 0x7101, "flags are 0x%x, not 0x7101", c.flags);
+    check(!(c.flags & ~COMUX_CHUNK_FLAGS_VALID), "flags have invalid bits set");
+
+    // values are rounded down to a power of two, and capped at the maximum
+    comux_cinfo_segment_set(&c, 1000, 0);
+    check(comux_cinfo_segment_size(&c) == 512, "segment size is %lu, not 512",
+          comux_cinfo_segment_size(&c));
+    check(comux_cinfo_segment_gap(&c) == 0, "segment gap wasn't cleared");
+    comux_cinfo_segment_set(&c, 1 << 20, 1 << 20);
+    check(comux_cinfo_segment_size(&c) == COMUX_CHUNK_SEGMENT_MAXLEN,
+          "segment size wasn't capped");
+    check(comux_cinfo_segment_gap(&c) == COMUX_CHUNK_GAP_MAX,
+          "segment gap wasn't capped");
+
+    // turning segmentation off leaves just the real flags behind
+    comux_cinfo_segment_set(&c, 0, 0);
+    check(c.flags == COMUX_CHUNK_FLAGS_AWAIT_RESPONSE,
+          "flags are 0x%x after clearing segmentation", c.flags);
+    comux_cinfo_free(&c);
+}
+
+// Tests the RESET flag and its offset bits
+static void test_cinfo_reset()
+{
+    test_section("cinfo reset offset");
+    comux_cinfo_t c;
+    comux_cinfo_init(&c);
+    comux_cinfo_data_append(&c, "0123456789");
+    check(c.len == 10, "cinfo length is %lu, not 10", c.len);
+
+    // by default, the entire chunk is sent before resetting
+    comux_cinfo_reset_set(&c, 0);
+    check(c.flags == COMUX_CHUNK_FLAGS_RESET, "flags are 0x%x, not 0x%x",
+          c.flags, COMUX_CHUNK_FLAGS_RESET);
+    check(comux_cinfo_reset_offset(&c) == 10, "reset offset is %lu, not 10",
+          comux_cinfo_reset_offset(&c));
+
+    // an offset inside the chunk is encoded in the upper bits
+    comux_cinfo_segment_set(&c, 2, 0);
+    comux_cinfo_reset_set(&c, 4);
+    check(c.flags == 0x40204, "flags are 0x%x, not 0x40204", c.flags);
+    check(comux_cinfo_reset_offset(&c) == 4, "reset offset is %lu, not 4",
+          comux_cinfo_reset_offset(&c));
+    check(!(c.flags & ~COMUX_CHUNK_FLAGS_VALID), "flags have invalid bits set");
+
+    // offsets past the end of the chunk mean the entire chunk
+    comux_cinfo_reset_set(&c, 50);
+    check(comux_cinfo_reset_offset(&c) == 10, "reset offset is %lu, not 10",
+          comux_cinfo_reset_offset(&c));
+
+    // clearing the flag leaves the segmentation bits alone
+    comux_cinfo_reset_clear(&c);
+    check(c.flags == 0x200, "flags are 0x%x after clearing the reset", c.flags);
+    comux_cinfo_free(&c);
+
+    // a chunk bigger than 64 KiB can only be reset inside its first 64 KiB,
+    // or after the whole thing. (This is what a splice onto a big chunk has to
+    // check before moving a reset offset.)
+    comux_cinfo_init(&c);
+    char* big = calloc(70000, 1);
+    comux_cinfo_data_appendn(&c, big, 70000);
+    free(big);
+    check(comux_reset_offset_fits(c.len, 4), "offset 4 doesn't fit");
+    check(comux_reset_offset_fits(c.len, COMUX_CHUNK_RESET_OFFSET_MAX),
+          "the largest offset doesn't fit");
+    check(comux_reset_offset_fits(c.len, 0), "offset 0 doesn't fit");
+    check(comux_reset_offset_fits(c.len, c.len), "the full length doesn't fit");
+    check(!comux_reset_offset_fits(c.len, 65536), "offset 65536 fits");
+    check(!comux_reset_offset_fits(c.len, 69999), "offset 69999 fits");
+    comux_cinfo_reset_set(&c, 65536);
+    check(comux_cinfo_reset_offset(&c) == COMUX_CHUNK_RESET_OFFSET_MAX,
+          "reset offset is %lu, not capped", comux_cinfo_reset_offset(&c));
+    comux_cinfo_free(&c);
+}
+
 // Tests the comux manifest's cinfo list
 static void test_manifest_cinfo()
 {
@@ -581,6 +688,8 @@ int main()
     test_header_io();
     test_cinfo_io();
     test_cinfo_data_io();
+    test_cinfo_segment();
+    test_cinfo_reset();
     test_manifest_cinfo();
     test_manifest_full_io();
 